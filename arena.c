@@ -0,0 +1,148 @@
+/*****************************************************************************
+This file implements the memory arena. A region is mapped with MAP_HUGETLB
+when huge pages were reserved by the system; otherwise it is mapped aligned to
+a huge page and madvised with MADV_HUGEPAGE, so the kernel backs it with
+transparent huge pages where it can.
+ ****************************************************************************/
+#define _GNU_SOURCE /*for MAP_HUGETLB and MADV_HUGEPAGE*/
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+static uintptr_t align_up(uintptr_t p, size_t align){
+    return (p + align - 1) & ~(uintptr_t)(align - 1);
+}
+
+static size_t page_size(void){
+    static size_t size = 0;
+    if (!size)
+        size = (size_t)sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+/*
+ * maps a region of huge pages with MAP_HUGETLB. the guard page of a guarded
+ * region is mapped right below it, and if that address is taken the region
+ * is given up.
+ */
+static char *region_map_hugetlb(size_t size, int flags){
+#ifdef MAP_HUGETLB
+    char *p = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0), *guard;
+    if (p == MAP_FAILED)
+        return NULL;
+    if (!(flags & UT_ARENA_GUARD))
+        return p;
+#ifdef MAP_FIXED_NOREPLACE
+    guard = (char *)mmap(p - page_size(), page_size(), PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (guard == p - page_size())
+        return p;
+    if (guard != MAP_FAILED)
+        munmap(guard, page_size());
+#endif
+    munmap(p, size);
+#endif
+    return NULL;
+}
+
+/*
+ * maps a region of the given size (a multiple of UT_ARENA_REGION). for the
+ * alignment, a region larger by a huge page is mapped, and the ends around the
+ * aligned region (and its guard page) are unmapped.
+ */
+static char *region_map(size_t size, int flags){
+    char *p, *start, *low;
+    if ((start = region_map_hugetlb(size, flags)))
+        return start;
+    p = (char *)mmap(NULL, size + UT_ARENA_REGION, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    if (flags & UT_ARENA_GUARD){
+        start = (char *)align_up((uintptr_t)p + page_size(), UT_ARENA_REGION);
+        low = start - page_size();
+        mprotect(low, page_size(), PROT_NONE);
+    }
+    else
+        low = start = (char *)align_up((uintptr_t)p, UT_ARENA_REGION);
+    if (low > p)
+        munmap(p, low - p);
+    if (p + UT_ARENA_REGION > start)
+        munmap(start + size, p + UT_ARENA_REGION - start);
+#ifdef MADV_HUGEPAGE
+    madvise(start, size, MADV_HUGEPAGE);
+#endif
+    return start;
+}
+
+void ut_arena_init(ut_arena_t *arena, int flags){
+    arena->regions = NULL;
+    arena->free = NULL;
+    arena->flags = flags;
+}
+
+/*
+ * behaves as described in the header: takes a block handed back with the same
+ * size and a fitting alignment, or bumps the current region, or maps a new
+ * region large enough for the memory. the rest of the current region is left
+ * unused once a new region is mapped.
+ */
+void *ut_arena_alloc(ut_arena_t *arena, size_t size, size_t align){
+    ut_arena_block_t **b;
+    ut_arena_region_t *r = arena->regions;
+    uintptr_t p;
+    size_t region_size;
+    char *base;
+    for (b = &(arena->free); *b; b = &((*b)->next)){
+        if ((*b)->size == size && ((uintptr_t)*b & (align - 1)) == 0){
+            p = (uintptr_t)*b;
+            *b = (*b)->next;
+            return (void *)p;
+        }
+    }
+    if (r){
+        p = align_up((uintptr_t)r->base + r->used, align);
+        if (p + size <= (uintptr_t)r){
+            r->used = p + size - (uintptr_t)r->base;
+            return (void *)p;
+        }
+    }
+    region_size = align_up(size + align + sizeof(ut_arena_region_t), UT_ARENA_REGION);
+    if (!(base = region_map(region_size, arena->flags)))
+        return NULL;
+    r = (ut_arena_region_t *)(base + region_size - sizeof(ut_arena_region_t));
+    r->next = arena->regions;
+    r->base = base;
+    r->size = region_size;
+    arena->regions = r;
+    p = align_up((uintptr_t)base, align);
+    r->used = p + size - (uintptr_t)base;
+    return (void *)p;
+}
+
+void ut_arena_free(ut_arena_t *arena, void *p, size_t size){
+    ut_arena_block_t *b = (ut_arena_block_t *)p;
+    if (!p || size < sizeof(ut_arena_block_t))
+        return;
+    b->size = size;
+    b->next = arena->free;
+    arena->free = b;
+}
+
+/*
+ * behaves as described in the header. the guard page of a guarded region is
+ * unmapped along with it.
+ */
+void ut_arena_release(ut_arena_t *arena){
+    ut_arena_region_t *r = arena->regions, *next;
+    size_t guard = (arena->flags & UT_ARENA_GUARD) ? page_size() : 0;
+    while (r){
+        next = r->next;
+        munmap(r->base - guard, r->size + guard);
+        r = next;
+    }
+    ut_arena_init(arena, arena->flags);
+}
@@ -0,0 +1,105 @@
+/*****************************************************************************
+   File:        arena.h
+
+   Description: this file defines the memory arena of the user-level threads
+                library. An arena hands out memory from large contiguous
+                regions, by bumping a pointer, so allocating costs no system
+                call and no heap lock, and the memory handed out together
+                (like the threads table and the stacks) lies together. The
+                regions are aligned to huge pages and backed by them when the
+                system allows it, which saves TLB entries. Memory is not freed
+                piece by piece: the whole arena is released at once. A block
+                may however be handed back to be reused for a later
+                allocation of the same size (this is how a stack replaced by
+                one of another size is recycled).
+                An arena of stacks may have every region guarded by an
+                inaccessible page right below it. Guarding each stack would
+                take a small page of its own out of the huge pages, so an
+                overflow only faults for the lowest stack of a region, while
+                the others run into the stack below.
+ ****************************************************************************/
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+#define UT_ARENA_REGION (2UL << 20) // the (least) size of a region: a huge page.
+
+/* The arena flags (see ut_arena_init). */
+#define UT_ARENA_GUARD 1 // every region has a guard page below it.
+
+/*****************************************************************************
+  A region of an arena, which ends with this header (so the memory handed out
+  grows up from the region's base towards it, and a stack overflowing down
+  never runs into it).
+    next - the region allocated before this one.
+    base - the start of the region.
+    size - the size of the region, including this header.
+    used - the bytes handed out from the base of the region.
+*****************************************************************************/
+typedef struct ut_arena_region {
+  struct ut_arena_region *next;
+  char *base;
+  size_t size;
+  size_t used;
+} ut_arena_region_t;
+
+/*****************************************************************************
+  A block handed back to an arena, which holds this header while it waits to
+  be reused.
+    next - the next block handed back.
+    size - the size of the block.
+*****************************************************************************/
+typedef struct ut_arena_block {
+  struct ut_arena_block *next;
+  size_t size;
+} ut_arena_block_t;
+
+/*****************************************************************************
+  The arena type definition.
+    regions - the region memory is currently handed out from, followed by the
+    earlier ones.
+    free - the blocks handed back.
+    flags - the arena flags above.
+*****************************************************************************/
+typedef struct ut_arena {
+  ut_arena_region_t *regions;
+  ut_arena_block_t *free;
+  int flags;
+} ut_arena_t;
+
+/*****************************************************************************
+  Initializes an empty arena. No memory is mapped before the first
+  allocation.
+  Parameters:
+    flags - 0, or UT_ARENA_GUARD.
+*****************************************************************************/
+void ut_arena_init(ut_arena_t *arena, int flags);
+
+/*****************************************************************************
+  Allocates memory from an arena. Memory from a new region is zero filled,
+  while a block handed back by ut_arena_free() keeps its old contents.
+  Parameters:
+    size - the size of the memory, in bytes.
+    align - the alignment of the memory, a power of two.
+  Returns:
+    the memory, or NULL if a new region could not be mapped.
+*****************************************************************************/
+void *ut_arena_alloc(ut_arena_t *arena, size_t size, size_t align);
+
+/*****************************************************************************
+  Hands a block back to an arena, to be reused by an allocation of the same
+  size. Blocks smaller than ut_arena_block_t are not reused.
+  Parameters:
+    p - the block, as returned by ut_arena_alloc().
+    size - the size it was allocated with.
+*****************************************************************************/
+void ut_arena_free(ut_arena_t *arena, void *p, size_t size);
+
+/*****************************************************************************
+  Unmaps all the regions of an arena, which becomes empty again (with the
+  same flags). All the memory allocated from the arena is gone.
+*****************************************************************************/
+void ut_arena_release(ut_arena_t *arena);
+
+#endif
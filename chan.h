@@ -0,0 +1,158 @@
+/*****************************************************************************
+   File:        chan.h
+
+   Description: this file defines channels for passing data between user-level
+                threads. A channel carries elements of a fixed size, which are
+                copied in and out of it.
+                A channel created with capacity 0 is unbuffered: a send waits
+                until a receiver takes the element (and vice versa). A channel
+                with a positive capacity buffers up to that many elements, and
+                an UT_CHAN_UNBOUNDED channel grows its buffer as needed, so
+                sending on it never waits.
+                Whenever a thread is already waiting on the other side, the
+                element is copied directly between the two threads, bypassing
+                the buffer. Waiting threads are parked by the scheduler, and do
+                not consume CPU time until they are released.
+ ****************************************************************************/
+#ifndef _CHAN_H
+#define _CHAN_H
+
+#include <stddef.h>
+
+#include "ut.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHAN_CLOSED -3      // the channel was closed.
+#define CHAN_WOULDBLOCK -4  // the operation could not complete without waiting.
+
+#define UT_CHAN_UNBOUNDED ((size_t)-1) // capacity of a channel that never fills.
+
+#define UT_CHAN_SEND 1      // a send case of ut_select().
+#define UT_CHAN_RECV 2      // a receive case of ut_select().
+
+/*****************************************************************************
+  The channel type definition (its fields are private to chan.c).
+*****************************************************************************/
+typedef struct ut_chan ut_chan_t;
+
+/*****************************************************************************
+  A single case of ut_select().
+    chan - the channel to operate on. Cases with a NULL channel are ignored.
+    op - UT_CHAN_SEND or UT_CHAN_RECV.
+    elem - the element to send, or the buffer to receive into.
+    result - set by ut_select() for the case that completed: 0 on success,
+    or CHAN_CLOSED if the channel was closed.
+*****************************************************************************/
+typedef struct ut_select_case {
+  ut_chan_t *chan;
+  int op;
+  void *elem;
+  int result;
+} ut_select_case_t;
+
+/*****************************************************************************
+  Creates a new channel.
+  Parameters:
+    elem_size - the size (in bytes) of a single element. Must be positive.
+    capacity - the number of elements the channel buffers, 0 for an
+    unbuffered channel, or UT_CHAN_UNBOUNDED.
+  Returns:
+    the new channel, or NULL on allocation failure.
+*****************************************************************************/
+ut_chan_t *ut_chan_create(size_t elem_size, size_t capacity);
+
+/*****************************************************************************
+  Frees a channel. No thread may be using or waiting on the channel.
+  Parameters:
+    ch - the channel to free.
+*****************************************************************************/
+void ut_chan_destroy(ut_chan_t *ch);
+
+/*****************************************************************************
+  Sends an element, waiting while the channel has no room for it.
+  Parameters:
+    ch - the channel.
+    elem - points to the element to send.
+  Returns:
+    0 - on success.
+    CHAN_CLOSED - if the channel is (or was closed while waiting) closed.
+    UT_CANCELED - if the calling thread was canceled (see ut_cancel).
+    SYS_ERR - on allocation failure, or if the call should wait while the
+    scheduler is not running.
+*****************************************************************************/
+int ut_chan_send(ut_chan_t *ch, const void *elem);
+
+/*****************************************************************************
+  Receives an element, waiting while the channel is empty.
+  Parameters:
+    ch - the channel.
+    elem - points to the buffer to copy the element into.
+  Returns:
+    0 - on success.
+    CHAN_CLOSED - if the channel is closed and empty. elem is zeroed.
+    UT_CANCELED - if the calling thread was canceled (see ut_cancel).
+    SYS_ERR - if the call should wait while the scheduler is not running.
+*****************************************************************************/
+int ut_chan_recv(ut_chan_t *ch, void *elem);
+
+/*****************************************************************************
+  Like ut_chan_send() and ut_chan_recv(), but give up after a timeout.
+  Parameters:
+    usec - the longest time to wait, in microseconds.
+  Returns:
+    the same, or UT_TIMEDOUT if the operation could not complete in time
+    (nothing was sent or received then).
+*****************************************************************************/
+int ut_chan_send_timed(ut_chan_t *ch, const void *elem, unsigned long usec);
+int ut_chan_recv_timed(ut_chan_t *ch, void *elem, unsigned long usec);
+
+/*****************************************************************************
+  Non-waiting versions of ut_chan_send() and ut_chan_recv(). Both return
+  CHAN_WOULDBLOCK where the waiting version would wait, and otherwise behave
+  like it.
+*****************************************************************************/
+int ut_chan_try_send(ut_chan_t *ch, const void *elem);
+int ut_chan_try_recv(ut_chan_t *ch, void *elem);
+
+/*****************************************************************************
+  Closes a channel. Buffered elements may still be received, after which every
+  receive returns CHAN_CLOSED. Threads waiting to send are released with
+  CHAN_CLOSED, and so are threads waiting to receive.
+  Parameters:
+    ch - the channel.
+  Returns:
+    0 - on success.
+    CHAN_CLOSED - if the channel was already closed.
+*****************************************************************************/
+int ut_chan_close(ut_chan_t *ch);
+
+/*****************************************************************************
+  Returns the number of elements buffered in a channel.
+*****************************************************************************/
+size_t ut_chan_len(ut_chan_t *ch);
+
+/*****************************************************************************
+  Performs exactly one of several channel operations. If some cases can
+  complete right away, the first of them is performed. Otherwise the calling
+  thread waits until one of them can complete (if block is set).
+  Parameters:
+    cases - the cases array.
+    ncases - the number of cases.
+    block - if 0, return CHAN_WOULDBLOCK instead of waiting.
+  Returns:
+    the index of the case that completed (its result field tells how).
+    CHAN_WOULDBLOCK - if no case could complete and block is 0.
+    UT_CANCELED - if the calling thread was canceled while waiting.
+    SYS_ERR - if the call should wait while the scheduler is not running, or
+    there is no case to wait on.
+*****************************************************************************/
+int ut_select(ut_select_case_t *cases, int ncases, int block);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,556 @@
+/*****************************************************************************
+Comparison:
+this file runs the same workloads on user-level threads (the ut, binsem and
+chan libraries) and on kernel threads (pthreads, with mutexes and condition
+variables), and prints a CSV row per run: the throughput, the percentiles of
+the operations' latency, the peak resident memory and the number of kernel
+context switches. every run takes place in a child process of its own, so the
+memory and context switches reported by wait4() belong to that run alone.
+ ****************************************************************************/
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "binsem.h"
+#include "chan.h"
+#include "ut.h"
+
+#define DEFAULT_OPS     100000
+#define DEFAULT_THREADS 4
+#define DEFAULT_QUANTUM 10000 /*microseconds*/
+#define DEFAULT_WORK    1000  /*busy-loop iterations per unit of work*/
+#define QUEUE_CAPACITY  64
+
+/*
+ * a queue item: a value and the time it was queued at (for the latency).
+ */
+typedef struct item {
+  long value;
+  long stamp;
+} item_t;
+
+/*
+ * the primitives a workload is written against, once for every kind of
+ * threads. run() runs func(0) .. func(n - 1) in n threads and returns once
+ * all of them returned. the semaphores are binary, and the queues are
+ * bounded FIFOs of items.
+ */
+typedef struct backend {
+  const char *name;
+  void (*run)(void (*func)(int), int n);
+  void *(*sem_create)(int value);
+  void (*sem_up)(void *sem);
+  void (*sem_down)(void *sem);
+  void *(*queue_create)(int capacity);
+  void (*queue_put)(void *queue, const item_t *item);
+  void (*queue_get)(void *queue, item_t *item);
+} backend_t;
+
+/*
+ * what a child process reports back to its parent.
+ */
+typedef struct result {
+  long ops;
+  double seconds;
+  long p50, p99, max;
+} result_t;
+
+static long ops = DEFAULT_OPS;
+static int nthreads = DEFAULT_THREADS;
+static unsigned long quantum = DEFAULT_QUANTUM;
+static long work = DEFAULT_WORK;
+
+static const backend_t *be;  /*the backend of the running workload*/
+static long *samples;        /*latency samples, in nanoseconds*/
+static long nsamples;        /*updated atomically, kernel threads share it*/
+
+static long now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void add_sample(long ns){
+  long i = __atomic_fetch_add(&nsamples, 1, __ATOMIC_RELAXED);
+  if (i < ops)
+    samples[i] = ns;
+}
+
+static void busy(long iters){
+  volatile long j = 0;
+  long i;
+  for (i = 0; i < iters; i++)
+    j += i * i;
+}
+
+/*****************************************************************************
+  The user-level threads backend.
+*****************************************************************************/
+static void ut_run(void (*func)(int), int n){
+  int i;
+  if (ut_init(MAX_TAB_SIZE) == SYS_ERR){
+    perror("ut_init");
+    exit(1);
+  }
+  ut_set_quantum(quantum);
+  for (i = 0; i < n; i++)
+    if (ut_spawn_thread(func, i) < 0){
+      fprintf(stderr, "ut_spawn_thread failed\n");
+      exit(1);
+    }
+  if (ut_start() == SYS_ERR){
+    perror("ut_start");
+    exit(1);
+  }
+}
+
+static void *ut_sem_create(int value){
+  sem_t *s = (sem_t *)malloc(sizeof(sem_t));
+  binsem_init(s, value);
+  return s;
+}
+
+static void ut_sem_up(void *s){
+  binsem_up((sem_t *)s);
+}
+
+static void ut_sem_down(void *s){
+  binsem_down((sem_t *)s);
+}
+
+static void *ut_queue_create(int capacity){
+  return ut_chan_create(sizeof(item_t), capacity);
+}
+
+static void ut_queue_put(void *q, const item_t *item){
+  ut_chan_send((ut_chan_t *)q, item);
+}
+
+static void ut_queue_get(void *q, item_t *item){
+  ut_chan_recv((ut_chan_t *)q, item);
+}
+
+static const backend_t ut_backend = {
+  "ut", ut_run, ut_sem_create, ut_sem_up, ut_sem_down,
+  ut_queue_create, ut_queue_put, ut_queue_get
+};
+
+/*****************************************************************************
+  The pthreads backend.
+*****************************************************************************/
+typedef struct pt_sem {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int value;
+} pt_sem_t;
+
+typedef struct pt_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty, not_full;
+  item_t *buf;
+  int capacity, head, len;
+} pt_queue_t;
+
+typedef struct pt_start {
+  void (*func)(int);
+  int arg;
+} pt_start_t;
+
+static void *pt_thread(void *p){
+  pt_start_t *start = (pt_start_t *)p;
+  start->func(start->arg);
+  return NULL;
+}
+
+static void pt_run(void (*func)(int), int n){
+  pthread_t *threads = (pthread_t *)malloc(n * sizeof(pthread_t));
+  pt_start_t *starts = (pt_start_t *)malloc(n * sizeof(pt_start_t));
+  int i;
+  for (i = 0; i < n; i++){
+    starts[i].func = func;
+    starts[i].arg = i;
+    if (pthread_create(&threads[i], NULL, pt_thread, &starts[i]) != 0){
+      fprintf(stderr, "pthread_create failed\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < n; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  free(starts);
+}
+
+static void *pt_sem_create(int value){
+  pt_sem_t *s = (pt_sem_t *)malloc(sizeof(pt_sem_t));
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->cond, NULL);
+  s->value = value > 0;
+  return s;
+}
+
+static void pt_sem_up(void *p){
+  pt_sem_t *s = (pt_sem_t *)p;
+  pthread_mutex_lock(&s->lock);
+  s->value = 1;
+  pthread_cond_signal(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void pt_sem_down(void *p){
+  pt_sem_t *s = (pt_sem_t *)p;
+  pthread_mutex_lock(&s->lock);
+  while (!s->value)
+    pthread_cond_wait(&s->cond, &s->lock);
+  s->value = 0;
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void *pt_queue_create(int capacity){
+  pt_queue_t *q = (pt_queue_t *)malloc(sizeof(pt_queue_t));
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->not_empty, NULL);
+  pthread_cond_init(&q->not_full, NULL);
+  q->buf = (item_t *)malloc(capacity * sizeof(item_t));
+  q->capacity = capacity;
+  q->head = q->len = 0;
+  return q;
+}
+
+static void pt_queue_put(void *p, const item_t *item){
+  pt_queue_t *q = (pt_queue_t *)p;
+  pthread_mutex_lock(&q->lock);
+  while (q->len == q->capacity)
+    pthread_cond_wait(&q->not_full, &q->lock);
+  q->buf[(q->head + q->len++) % q->capacity] = *item;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static void pt_queue_get(void *p, item_t *item){
+  pt_queue_t *q = (pt_queue_t *)p;
+  pthread_mutex_lock(&q->lock);
+  while (q->len == 0)
+    pthread_cond_wait(&q->not_empty, &q->lock);
+  *item = q->buf[q->head];
+  q->head = (q->head + 1) % q->capacity;
+  q->len--;
+  pthread_cond_signal(&q->not_full);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static const backend_t pt_backend = {
+  "pthread", pt_run, pt_sem_create, pt_sem_up, pt_sem_down,
+  pt_queue_create, pt_queue_put, pt_queue_get
+};
+
+/*****************************************************************************
+  The workloads. Each one sets up its shared objects and runs its threads,
+  and returns the number of operations done. Every thread only uses the
+  backend's primitives, so the threads' code is the same for both kinds of
+  threads.
+*****************************************************************************/
+
+/*
+ * pingpong: two threads pass control back and forth through two semaphores,
+ * the latency is half a round trip.
+ */
+static void *sem_ping, *sem_pong;
+
+static void pingpong_thread(int id){
+  long i, t;
+  for (i = 0; i < ops; i++){
+    if (id == 0){
+      t = now_ns();
+      be->sem_up(sem_ping);
+      be->sem_down(sem_pong);
+      add_sample((now_ns() - t) / 2);
+    }
+    else{
+      be->sem_down(sem_ping);
+      be->sem_up(sem_pong);
+    }
+  }
+}
+
+static long pingpong(void){
+  sem_ping = be->sem_create(0);
+  sem_pong = be->sem_create(0);
+  be->run(pingpong_thread, 2);
+  return ops;
+}
+
+/*
+ * philosophers: nthreads philosophers share ops meals, as in ph.c (a mutex
+ * semaphore and a semaphore per philosopher). the latency is the time from
+ * getting hungry to eating.
+ */
+#define THINKING 0
+#define HUNGRY   1
+#define EATING   2
+
+static void *phil_mutex;
+static void **phil_sem;
+static volatile int *phil_state;
+
+static void phil_test(int i){
+  int left = (i + nthreads - 1) % nthreads, right = (i + 1) % nthreads;
+  if (phil_state[i] == HUNGRY && phil_state[left] != EATING && phil_state[right] != EATING){
+    phil_state[i] = EATING;
+    be->sem_up(phil_sem[i]);
+  }
+}
+
+static void phil_thread(int i){
+  long meal, t;
+  for (meal = 0; meal < ops / nthreads; meal++){
+    busy(work);
+    t = now_ns();
+    be->sem_down(phil_mutex);
+    phil_state[i] = HUNGRY;
+    phil_test(i);
+    be->sem_up(phil_mutex);
+    be->sem_down(phil_sem[i]);
+    add_sample(now_ns() - t);
+    busy(work);
+    be->sem_down(phil_mutex);
+    phil_state[i] = THINKING;
+    phil_test((i + nthreads - 1) % nthreads);
+    phil_test((i + 1) % nthreads);
+    be->sem_up(phil_mutex);
+  }
+}
+
+static long philosophers(void){
+  int i;
+  phil_mutex = be->sem_create(1);
+  phil_sem = (void **)malloc(nthreads * sizeof(void *));
+  phil_state = (int *)calloc(nthreads, sizeof(int));
+  for (i = 0; i < nthreads; i++)
+    phil_sem[i] = be->sem_create(0);
+  be->run(phil_thread, nthreads);
+  return (ops / nthreads) * nthreads;
+}
+
+/*
+ * prodcons: half of the threads produce items into a bounded queue and the
+ * others consume them, with a unit of work per item. the last producer to
+ * finish sends a negative item to every consumer. the latency is the time an
+ * item spent in the queue.
+ */
+static void *pc_queue;
+static int producers, consumers, producers_left;
+
+static void prodcons_thread(int id){
+  item_t item;
+  long i;
+  if (id < producers){
+    for (i = 0; i < ops / producers; i++){
+      item.value = i;
+      item.stamp = now_ns();
+      be->queue_put(pc_queue, &item);
+    }
+    if (__atomic_sub_fetch(&producers_left, 1, __ATOMIC_ACQ_REL) == 0)
+      for (i = 0; i < consumers; i++){
+        item.value = -1;
+        be->queue_put(pc_queue, &item);
+      }
+    return;
+  }
+  while (1){
+    be->queue_get(pc_queue, &item);
+    if (item.value < 0)
+      break;
+    add_sample(now_ns() - item.stamp);
+    busy(work);
+  }
+}
+
+static long prodcons(void){
+  producers = (nthreads > 1) ? nthreads / 2 : 1;
+  consumers = (nthreads > 1) ? nthreads - producers : 1;
+  producers_left = producers;
+  pc_queue = be->queue_create(QUEUE_CAPACITY);
+  be->run(prodcons_thread, producers + consumers);
+  return (ops / producers) * producers;
+}
+
+/*
+ * fanout: thread 0 hands out tasks in rounds of a task per worker, and
+ * collects the results of a round before starting the next one. the
+ * workers do a unit of work per task. the latency is the time from handing
+ * out a task to collecting its result.
+ */
+static void *task_queue, *result_queue;
+static int workers;
+
+static void fanout_thread(int id){
+  item_t item;
+  long done, i;
+  if (id == 0){
+    for (done = 0; done < ops; done += i){
+      for (i = 0; i < workers && done + i < ops; i++){
+        item.value = done + i;
+        item.stamp = now_ns();
+        be->queue_put(task_queue, &item);
+      }
+      for (i = 0; i < workers && done + i < ops; i++){
+        be->queue_get(result_queue, &item);
+        add_sample(now_ns() - item.stamp);
+      }
+    }
+    for (i = 0; i < workers; i++){
+      item.value = -1;
+      be->queue_put(task_queue, &item);
+    }
+    return;
+  }
+  while (1){
+    be->queue_get(task_queue, &item);
+    if (item.value < 0)
+      break;
+    busy(work);
+    be->queue_put(result_queue, &item);
+  }
+}
+
+static long fanout(void){
+  workers = (nthreads > 1) ? nthreads - 1 : 1;
+  task_queue = be->queue_create(workers);
+  result_queue = be->queue_create(workers);
+  be->run(fanout_thread, workers + 1);
+  return ops;
+}
+
+typedef struct workload {
+  const char *name;
+  long (*run)(void);
+} workload_t;
+
+static const workload_t workloads[] = {
+  {"pingpong", pingpong},
+  {"philosophers", philosophers},
+  {"prodcons", prodcons},
+  {"fanout", fanout},
+};
+
+#define NWORKLOADS ((int)(sizeof(workloads) / sizeof(workloads[0])))
+
+static int cmp_long(const void *a, const void *b){
+  long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * runs a workload in the calling (child) process and fills its result.
+ */
+static void run_child(const workload_t *w, result_t *r){
+  long start, n;
+  samples = (long *)malloc(ops * sizeof(long));
+  nsamples = 0;
+  start = now_ns();
+  r->ops = w->run();
+  r->seconds = (now_ns() - start) / 1e9;
+  n = (nsamples < ops) ? nsamples : ops;
+  r->p50 = r->p99 = r->max = 0;
+  if (n > 0){
+    qsort(samples, n, sizeof(long), cmp_long);
+    r->p50 = samples[(n - 1) / 2];
+    r->p99 = samples[(long)(0.99 * (n - 1))];
+    r->max = samples[n - 1];
+  }
+}
+
+/*
+ * runs a workload in a child process, which sends its result through a
+ * pipe, and prints the result with the child's resource usage.
+ */
+static int run_forked(const workload_t *w, const backend_t *b){
+  int fds[2], status;
+  pid_t pid;
+  result_t r;
+  struct rusage ru;
+  if (pipe(fds) == -1){
+    perror("pipe");
+    return -1;
+  }
+  fflush(stdout);
+  pid = fork();
+  if (pid == -1){
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0){
+    close(fds[0]);
+    be = b;
+    run_child(w, &r);
+    if (write(fds[1], &r, sizeof(r)) != sizeof(r))
+      _exit(1);
+    _exit(0);
+  }
+  close(fds[1]);
+  if (read(fds[0], &r, sizeof(r)) != sizeof(r))
+    memset(&r, 0, sizeof(r));
+  close(fds[0]);
+  if (wait4(pid, &status, 0, &ru) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+    fprintf(stderr, "%s/%s: the run failed\n", w->name, b->name);
+    return -1;
+  }
+  printf("%s,%s,%d,%ld,%.3f,%.0f,%ld,%ld,%ld,%ld,%ld,%ld\n", w->name, b->name,
+         nthreads, r.ops, r.seconds, r.seconds > 0 ? r.ops / r.seconds : 0,
+         r.p50, r.p99, r.max, ru.ru_maxrss, ru.ru_nvcsw, ru.ru_nivcsw);
+  return 0;
+}
+
+static void usage(const char *prog){
+  int i;
+  fprintf(stderr,
+          "Usage: %s [-n ops] [-t threads] [-q quantum_usec] [-w work] [workload ...]\n"
+          "  workloads:", prog);
+  for (i = 0; i < NWORKLOADS; i++)
+    fprintf(stderr, " %s", workloads[i].name);
+  fprintf(stderr, " (all by default)\n"
+          "  prints CSV rows: workload,impl,threads,ops,seconds,ops_per_sec,\n"
+          "  p50_ns,p99_ns,max_ns,maxrss_kb,voluntary_csw,involuntary_csw\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]){
+  const backend_t *backends[] = {&ut_backend, &pt_backend};
+  int c, i, j, failed = 0;
+  while ((c = getopt(argc, argv, "n:t:q:w:")) != -1){
+    switch (c){
+    case 'n': ops = atol(optarg); break;
+    case 't': nthreads = atoi(optarg); break;
+    case 'q': quantum = strtoul(optarg, NULL, 10); break;
+    case 'w': work = atol(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (ops < 1 || nthreads < 2 || nthreads >= MAX_TAB_SIZE || quantum == 0 || work < 0)
+    usage(argv[0]);
+  for (i = optind; i < argc; i++){
+    for (j = 0; j < NWORKLOADS && strcmp(argv[i], workloads[j].name) != 0; j++)
+      ;
+    if (j == NWORKLOADS)
+      usage(argv[0]);
+  }
+  printf("workload,impl,threads,ops,seconds,ops_per_sec,p50_ns,p99_ns,max_ns,"
+         "maxrss_kb,voluntary_csw,involuntary_csw\n");
+  for (i = 0; i < NWORKLOADS; i++){
+    if (optind < argc){
+      for (j = optind; j < argc && strcmp(argv[j], workloads[i].name) != 0; j++)
+        ;
+      if (j == argc)
+        continue;
+    }
+    for (j = 0; j < 2; j++)
+      failed |= run_forked(&workloads[i], backends[j]);
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,165 @@
+/*****************************************************************************
+This file implements futures on top of the scheduler hooks (see ut_sched.h).
+A waiting thread keeps a waiter on its stack in the list of every future it
+waits for, so ut_when_any() waits for all of them at once.
+ ****************************************************************************/
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "future.h"
+#include "ut_sched.h"
+
+/*
+ * a thread waiting for a future, kept on the stack of the waiting thread.
+ */
+typedef struct future_waiter {
+    tid_t tid;
+    struct future_waiter *next;
+} future_waiter_t;
+
+/*
+ * the function and argument of ut_spawn_future(), copied onto the new
+ * thread's stack.
+ */
+typedef struct future_call {
+    void *(*fn)(void *);
+    void *arg;
+    ut_promise_t *promise;
+} future_call_t;
+
+void ut_promise_init(ut_promise_t *p){
+    p->future.ready = 0;
+    p->future.value = NULL;
+    p->future.waiters = NULL;
+}
+
+ut_future_t *ut_promise_future(ut_promise_t *p){
+    return &(p->future);
+}
+
+/*
+ * the waiters remove themselves from the list once they run again, so the
+ * list is taken over as a whole and only unparked here.
+ */
+int ut_promise_set(ut_promise_t *p, void *value){
+    ut_future_t *f = &(p->future);
+    future_waiter_t *w;
+    ut_sched_lock();
+    if (f->ready){
+        ut_sched_unlock();
+        return FUTURE_ALREADY_SET;
+    }
+    f->value = value;
+    f->ready = 1;
+    for (w = f->waiters; w; w = w->next)
+        ut_unpark(w->tid);
+    f->waiters = NULL;
+    ut_sched_unlock();
+    return 0;
+}
+
+int ut_future_ready(ut_future_t *f){
+    return f->ready;
+}
+
+/*
+ * removes a waiter from the list of a future, if it is there. should be
+ * called with the scheduler lock held.
+ */
+static void future_unlink(ut_future_t *f, future_waiter_t *w){
+    future_waiter_t **p;
+    for (p = &(f->waiters); *p; p = &((*p)->next))
+        if (*p == w){
+            *p = w->next;
+            return;
+        }
+}
+
+/*
+ * parks until one of the first n futures is ready, with a waiter in the list
+ * of each (so ws holds n waiters). returns the index of the lowest ready
+ * future, or SYS_ERR. should be called with the scheduler lock held.
+ */
+static int future_wait_any(ut_future_t **futures, future_waiter_t *ws, int n){
+    int i, ret = 0;
+    for (;;){
+        for (i = 0; i < n; i++)
+            if (futures[i]->ready)
+                break;
+        if (i < n || ret != 0)
+            break;
+        for (i = 0; i < n; i++){
+            ws[i].tid = ut_self();
+            ws[i].next = futures[i]->waiters;
+            futures[i]->waiters = &(ws[i]);
+        }
+        ret = ut_park();
+        for (i = 0; i < n; i++)
+            future_unlink(futures[i], &(ws[i]));
+    }
+    return (i < n) ? i : SYS_ERR;
+}
+
+int ut_future_get(ut_future_t *f, void **value){
+    future_waiter_t w;
+    int ret = 0;
+    if (!f->ready){
+        ut_sched_lock();
+        ret = future_wait_any(&f, &w, 1);
+        ut_sched_unlock();
+        if (ret == SYS_ERR)
+            return SYS_ERR;
+    }
+    if (value)
+        *value = f->value;
+    return 0;
+}
+
+/*
+ * waits for the futures one at a time: a future which gets ready while the
+ * caller waits for another one costs no wakeup later.
+ */
+int ut_when_all(ut_future_t **futures, int n){
+    int i;
+    for (i = 0; i < n; i++)
+        if (ut_future_get(futures[i], NULL) != 0)
+            return SYS_ERR;
+    return 0;
+}
+
+/*
+ * the waiters are on the caller's stack, or allocated for a large set (only
+ * if none of the futures is ready already).
+ */
+int ut_when_any(ut_future_t **futures, int n){
+    future_waiter_t local[8], *ws = local;
+    int ret;
+    if (n <= 0)
+        return SYS_ERR;
+    for (ret = 0; ret < n; ret++)
+        if (futures[ret]->ready)
+            return ret;
+    if (n > (int)(sizeof(local) / sizeof(local[0])) &&
+        !(ws = (future_waiter_t *)malloc(n * sizeof(future_waiter_t))))
+        return SYS_ERR;
+    ut_sched_lock();
+    ret = future_wait_any(futures, ws, n);
+    ut_sched_unlock();
+    if (ws != local)
+        free(ws);
+    return ret;
+}
+
+static void future_run(void *payload){
+    future_call_t *call = (future_call_t *)payload;
+    ut_promise_set(call->promise, call->fn(call->arg));
+}
+
+tid_t ut_spawn_future(ut_promise_t *p, void *(*fn)(void *), void *arg,
+                      const ut_attr_t *attr){
+    future_call_t call;
+    call.fn = fn;
+    call.arg = arg;
+    call.promise = p;
+    return ut_spawn_copy(future_run, &call, sizeof(call), attr);
+}
@@ -0,0 +1,135 @@
+/*****************************************************************************
+   File:        future.h
+
+   Description: this file defines single-assignment futures for user-level
+                threads. A promise is set once, with a pointer-sized value,
+                and every thread getting its future parks until then (one
+                unpark per waiting thread, with no semaphore in between).
+                ut_spawn_future() runs a function returning a value in a new
+                thread, and sets a promise with what it returns, so a thread
+                can hand back its result without a global variable.
+                ut_when_all() and ut_when_any() wait for a whole set of
+                futures, or for the first of them, while parking once per
+                wakeup.
+                Promises are set and futures are waited for by user-level
+                threads (not by foreign kernel threads).
+ ****************************************************************************/
+#ifndef _FUTURE_H
+#define _FUTURE_H
+
+#include "ut.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FUTURE_ALREADY_SET -7 // the promise was set already.
+
+struct future_waiter;
+
+/*****************************************************************************
+  The future type definition, the read side of a promise. The fields are
+  private to future.c.
+*****************************************************************************/
+typedef struct ut_future {
+  int ready;                       // set once the value is.
+  void *value;
+  struct future_waiter *waiters;   // the parked threads.
+} ut_future_t;
+
+/*****************************************************************************
+  The promise type definition, the write side of its future.
+*****************************************************************************/
+typedef struct ut_promise {
+  ut_future_t future;
+} ut_promise_t;
+
+/*****************************************************************************
+  Initializes a promise, with its future not ready. A promise may be
+  initialized again (and reused) once no thread waits for its future.
+  Parameters:
+    p - pointer to the promise to be initialized.
+*****************************************************************************/
+void ut_promise_init(ut_promise_t *p);
+
+/*****************************************************************************
+  Returns the future of a promise.
+*****************************************************************************/
+ut_future_t *ut_promise_future(ut_promise_t *p);
+
+/*****************************************************************************
+  Sets the value of a promise, and unparks every thread waiting for its
+  future.
+  Parameters:
+    p - pointer to the promise.
+    value - the value.
+  Returns:
+    0 - on success.
+    FUTURE_ALREADY_SET - if the promise was set before (the value is kept).
+*****************************************************************************/
+int ut_promise_set(ut_promise_t *p, void *value);
+
+/*****************************************************************************
+  Returns 1 if a future is ready, and 0 otherwise. Never waits.
+*****************************************************************************/
+int ut_future_ready(ut_future_t *f);
+
+/*****************************************************************************
+  Waits for a future to be ready, and reads its value.
+  Parameters:
+    f - pointer to the future.
+    value - where the value is stored, or NULL.
+  Returns:
+    0 - on success.
+    SYS_ERR - if the calling thread should wait while the scheduler is not
+    running.
+*****************************************************************************/
+int ut_future_get(ut_future_t *f, void **value);
+
+/*****************************************************************************
+  Waits until every future of a set is ready.
+  Parameters:
+    futures - an array of pointers to futures.
+    n - the number of futures.
+  Returns:
+    0 - on success.
+    SYS_ERR - if the calling thread should wait while the scheduler is not
+    running.
+*****************************************************************************/
+int ut_when_all(ut_future_t **futures, int n);
+
+/*****************************************************************************
+  Waits until any future of a set is ready.
+  Parameters:
+    futures - an array of pointers to futures.
+    n - the number of futures (at least 1).
+  Returns:
+    the index of a ready future (the lowest one, if several are) - on
+    success.
+    SYS_ERR - if n is not positive, if the calling thread should wait while
+    the scheduler is not running, or on allocation failure.
+*****************************************************************************/
+int ut_when_any(ut_future_t **futures, int n);
+
+/*****************************************************************************
+  Spawns a thread running a function which returns a value, and sets a
+  promise with the value when the function returns. The function and its
+  argument are copied onto the new thread's stack (see ut_spawn_copy()), so
+  nothing is allocated besides the thread.
+  Parameters:
+    p - the promise, initialized and not set. It must outlive the thread.
+    fn - the function to run in the new thread.
+    arg - the argument for fn.
+    attr - the attributes of the new thread, or NULL for the defaults (a
+    joinable thread must still be joined).
+  Returns:
+    the same as ut_spawn().
+*****************************************************************************/
+tid_t ut_spawn_future(ut_promise_t *p, void *(*fn)(void *), void *arg,
+                      const ut_attr_t *attr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,74 @@
+/*****************************************************************************
+This file implements the log-linear histograms. Values below
+UT_HIST_SUB_BUCKETS get a bucket each. A larger value is bucketed by the
+position of its highest set bit (its power of two range) and the
+UT_HIST_SUB_BITS bits right below it (its place within the range).
+ ****************************************************************************/
+#include <string.h>
+
+#include "hist.h"
+
+void ut_hist_init(ut_hist_t *h){
+    memset(h, 0, sizeof(ut_hist_t));
+}
+
+/*
+ * the bucket of a value. the first range (exponent UT_HIST_SUB_BITS) starts
+ * right after the buckets of the small values.
+ */
+static int hist_bucket(unsigned long long value){
+    int exp;
+    if (value < UT_HIST_SUB_BUCKETS)
+        return (int)value;
+    exp = 63 - __builtin_clzll(value);
+    if (exp > UT_HIST_MAX_EXP)
+        return UT_HIST_BUCKETS - 1;
+    return (exp - UT_HIST_SUB_BITS + 1) * UT_HIST_SUB_BUCKETS +
+           (int)((value >> (exp - UT_HIST_SUB_BITS)) & (UT_HIST_SUB_BUCKETS - 1));
+}
+
+/*
+ * the highest value which falls in a bucket.
+ */
+static unsigned long long hist_bucket_top(int bucket){
+    int exp, sub;
+    if (bucket < UT_HIST_SUB_BUCKETS)
+        return bucket;
+    exp = bucket / UT_HIST_SUB_BUCKETS + UT_HIST_SUB_BITS - 1;
+    sub = bucket % UT_HIST_SUB_BUCKETS;
+    return ((unsigned long long)(UT_HIST_SUB_BUCKETS + sub + 1) << (exp - UT_HIST_SUB_BITS)) - 1;
+}
+
+void ut_hist_record(ut_hist_t *h, unsigned long long value){
+    h->buckets[hist_bucket(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value > h->max)
+        h->max = value;
+}
+
+/*
+ * behaves as described in the header: finds the bucket where the running
+ * count of values reaches the requested rank.
+ */
+unsigned long long ut_hist_percentile(const ut_hist_t *h, double percentile){
+    unsigned long rank, seen = 0;
+    unsigned long long top;
+    int i;
+    if (h->count == 0)
+        return 0;
+    if (percentile < 0)
+        percentile = 0;
+    if (percentile > 100)
+        percentile = 100;
+    rank = (unsigned long)(percentile / 100 * h->count + 0.5);
+    if (rank == 0)
+        rank = 1;
+    for (i = 0; i < UT_HIST_BUCKETS; i++){
+        seen += h->buckets[i];
+        if (seen >= rank)
+            break;
+    }
+    top = hist_bucket_top(i);
+    return (top < h->max) ? top : h->max;
+}
@@ -0,0 +1,68 @@
+/*****************************************************************************
+   File:        hist.h
+
+   Description: this file defines log-linear histograms of latencies (after
+                the HDR histogram). Every power of two range of values is
+                split into UT_HIST_SUB_BUCKETS equal buckets, so a value is
+                recorded with a relative error of at most 1/UT_HIST_SUB_BUCKETS
+                whatever its magnitude, in a small fixed-size array of
+                counters. Recording a value costs a few instructions and no
+                allocation, so the scheduler records a value on every switch.
+ ****************************************************************************/
+#ifndef _HIST_H
+#define _HIST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UT_HIST_SUB_BITS 3                       // log2 of the buckets per power of two.
+#define UT_HIST_SUB_BUCKETS (1 << UT_HIST_SUB_BITS)
+#define UT_HIST_MAX_EXP 40                       // values from 2^40 (about 18 minutes in
+                                                 // nanoseconds) up fall in the last bucket.
+#define UT_HIST_BUCKETS ((UT_HIST_MAX_EXP - UT_HIST_SUB_BITS + 2) * UT_HIST_SUB_BUCKETS)
+
+/*****************************************************************************
+  The histogram type definition.
+    count - the number of recorded values.
+    max - the largest recorded value.
+    sum - the sum of the recorded values (for the mean).
+    buckets - the number of recorded values in every bucket.
+*****************************************************************************/
+typedef struct ut_hist {
+  unsigned long count;
+  unsigned long long max;
+  unsigned long long sum;
+  unsigned int buckets[UT_HIST_BUCKETS];
+} ut_hist_t;
+
+/*****************************************************************************
+  Empties a histogram.
+  Parameters:
+    h - the histogram.
+*****************************************************************************/
+void ut_hist_init(ut_hist_t *h);
+
+/*****************************************************************************
+  Records a value in a histogram.
+  Parameters:
+    h - the histogram.
+    value - the value to record.
+*****************************************************************************/
+void ut_hist_record(ut_hist_t *h, unsigned long long value);
+
+/*****************************************************************************
+  Returns the value below which the given percentage of the recorded values
+  falls: the highest value of the bucket holding that percentile (but never
+  more than the largest recorded value), or 0 if the histogram is empty.
+  Parameters:
+    h - the histogram.
+    percentile - between 0 and 100 (like 50 for the median, or 99.9).
+*****************************************************************************/
+unsigned long long ut_hist_percentile(const ut_hist_t *h, double percentile);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,136 @@
+/*****************************************************************************
+This file implements the hybrid semaphores. The value is changed lock free,
+so an uncontended down() or up() is a single atomic operation. The lists of
+waiters are protected by a spin lock, which user-level threads only take with
+the scheduler lock held, so a spin lock holder is never preempted by the
+scheduler.
+ ****************************************************************************/
+#include <stddef.h>
+
+#include "hsem.h"
+#include "ut_sched.h"
+
+/*
+ * a parked user-level thread, kept on its own stack. granted is set by the
+ * up() which hands the unit to it.
+ */
+typedef struct hsem_waiter {
+    tid_t tid;
+    int granted;
+    struct hsem_waiter *next;
+} hsem_waiter_t;
+
+static void hsem_lock(ut_hsem_t *s){
+    while (ut_atomic_xchg(&(s->lock), 1, UT_ACQUIRE))
+        while (ut_atomic_load(&(s->lock), UT_RELAXED))
+            ut_cpu_relax();
+}
+
+static void hsem_unlock(ut_hsem_t *s){
+    ut_atomic_store(&(s->lock), 0, UT_RELEASE);
+}
+
+void ut_hsem_init(ut_hsem_t *s, int init_val){
+    s->value = (init_val > 0) ? init_val : 0;
+    s->lock = 0;
+    s->foreign_waiters = 0;
+    s->head = s->tail = NULL;
+}
+
+int ut_hsem_trydown(ut_hsem_t *s){
+    int v = ut_atomic_load(&(s->value), UT_RELAXED);
+    while (v > 0)
+        if (ut_atomic_cas(&(s->value), &v, v - 1, UT_ACQUIRE))
+            return 1;
+    return 0;
+}
+
+/*
+ * a foreign kernel thread counts itself as sleeping before it sleeps on the
+ * value, with the lock held, so an up() which raises the value after the
+ * thread saw it at 0 also sees the thread and wakes it (and if the value was
+ * raised before the thread got to sleep, the futex does not sleep at all).
+ */
+static int hsem_down_foreign(ut_hsem_t *s){
+    for (;;){
+        hsem_lock(s);
+        if (ut_hsem_trydown(s)){
+            hsem_unlock(s);
+            return 0;
+        }
+        s->foreign_waiters++;
+        hsem_unlock(s);
+        ut_futex_wait(&(s->value), 0);
+        hsem_lock(s);
+        s->foreign_waiters--;
+        hsem_unlock(s);
+    }
+}
+
+/*
+ * a user-level thread queues itself and parks until an up() grants it the
+ * unit (re-parking in case it was unparked for another reason).
+ */
+int ut_hsem_down(ut_hsem_t *s){
+    hsem_waiter_t w;
+    int ret = 0;
+    if (ut_hsem_trydown(s))
+        return 0;
+    if (!ut_in_scheduler())
+        return hsem_down_foreign(s);
+    ut_sched_lock();
+    hsem_lock(s);
+    if (ut_hsem_trydown(s)){
+        hsem_unlock(s);
+        ut_sched_unlock();
+        return 0;
+    }
+    w.tid = ut_self();
+    w.granted = 0;
+    w.next = NULL;
+    if (s->tail)
+        s->tail->next = &w;
+    else
+        s->head = &w;
+    s->tail = &w;
+    hsem_unlock(s);
+    while (!ut_atomic_load(&(w.granted), UT_ACQUIRE) && (ret = ut_park()) == 0)
+        ;
+    ut_sched_unlock();
+    return ret;
+}
+
+/*
+ * behaves as described in the header. the waiter's TID is read before it is
+ * granted the unit, since once granted the waiter may return and its record
+ * (on its stack) may be gone.
+ */
+void ut_hsem_up(ut_hsem_t *s){
+    hsem_waiter_t *w;
+    tid_t tid;
+    int local = ut_in_scheduler(), foreign;
+    if (local)
+        ut_sched_lock();
+    hsem_lock(s);
+    if ((w = s->head)){
+        s->head = w->next;
+        if (!s->head)
+            s->tail = NULL;
+        tid = w->tid;
+        ut_atomic_store(&(w->granted), 1, UT_RELEASE);
+        hsem_unlock(s);
+        if (local)
+            ut_unpark(tid);
+        else
+            ut_unpark_remote(tid);
+    }
+    else{
+        ut_atomic_fetch_add(&(s->value), 1, UT_RELEASE);
+        foreign = s->foreign_waiters;
+        hsem_unlock(s);
+        if (foreign)
+            ut_futex_wake(&(s->value), 1);
+    }
+    if (local)
+        ut_sched_unlock();
+}
@@ -0,0 +1,78 @@
+/*****************************************************************************
+   File:        hsem.h
+
+   Description: this file defines hybrid counting semaphores, which may be
+                used both by user-level threads and by foreign kernel threads
+                of the same process (like native pthreads running blocking
+                libraries), so the two can hand work to each other without
+                polling.
+                A user-level thread that must wait parks in the scheduler,
+                like on a binary semaphore. A foreign kernel thread that must
+                wait sleeps in the kernel on a futex. An up() releases a parked
+                user-level thread first (handing the unit directly to it), and
+                otherwise raises the value and wakes a sleeping kernel thread.
+                A user-level thread released by a foreign kernel thread runs
+                at the scheduler's next switch.
+ ****************************************************************************/
+#ifndef _HSEM_H
+#define _HSEM_H
+
+#include "atomic.h"
+#include "ut.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct hsem_waiter;
+
+/*****************************************************************************
+  The semaphore type definition. The fields are private to hsem.c.
+*****************************************************************************/
+typedef struct ut_hsem {
+  int value;                         // the count, also the futex word.
+  int lock;                          // a spin lock protecting the fields below.
+  int foreign_waiters;               // kernel threads sleeping on value.
+  struct hsem_waiter *head, *tail;   // the parked user-level threads.
+} ut_hsem_t;
+
+/*****************************************************************************
+  Initializes a semaphore.
+  Parameters:
+    s - pointer to the semaphore to be initialized.
+    init_val - the initial (non-negative) value.
+*****************************************************************************/
+void ut_hsem_init(ut_hsem_t *s, int init_val);
+
+/*****************************************************************************
+  The Up() operation. May be called by user-level and foreign kernel threads.
+  Parameters:
+    s - pointer to the semaphore to be raised.
+*****************************************************************************/
+void ut_hsem_up(ut_hsem_t *s);
+
+/*****************************************************************************
+  The Down() operation. May be called by user-level and foreign kernel
+  threads (when called before ut_start() or after it returned, the caller is
+  treated as a foreign kernel thread).
+  Parameters:
+    s - pointer to the semaphore to be decremented. If its value is 0, the
+    caller waits until the semaphore is raised.
+  Returns:
+      0 - on success.
+*****************************************************************************/
+int ut_hsem_down(ut_hsem_t *s);
+
+/*****************************************************************************
+  The Down() operation, without waiting.
+  Returns:
+      1 - if the semaphore was decremented.
+      0 - if the semaphore value was 0.
+*****************************************************************************/
+int ut_hsem_trydown(ut_hsem_t *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
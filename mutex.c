@@ -0,0 +1,149 @@
+/*****************************************************************************
+This file implements mutexes on top of the binary semaphores, adding only the
+ownership checks, and condition variables on top of the scheduler hooks (see
+ut_sched.h).
+ ****************************************************************************/
+#include <stddef.h>
+
+#include "mutex.h"
+#include "ut_sched.h"
+
+/*
+ * a thread waiting on a condition variable, kept on its stack.
+ */
+typedef struct cond_waiter {
+    tid_t tid;
+    int signaled;
+    struct cond_waiter *next;
+} cond_waiter_t;
+
+void ut_mutex_init(ut_mutex_t *m){
+    binsem_init(&(m->sem), 1);
+}
+
+int ut_mutex_lock(ut_mutex_t *m){
+    return binsem_down(&(m->sem));
+}
+
+int ut_mutex_timedlock(ut_mutex_t *m, unsigned long usec){
+    return binsem_down_timed(&(m->sem), usec);
+}
+
+int ut_mutex_trylock(ut_mutex_t *m){
+    return binsem_trydown(&(m->sem)) ? 0 : MUTEX_BUSY;
+}
+
+/*
+ * the semaphore records the thread that lowered it, which for a mutex is
+ * the thread holding it.
+ */
+int ut_mutex_unlock(ut_mutex_t *m){
+    if (m->sem.value != 0 || m->sem.owner != ut_self())
+        return MUTEX_NOT_OWNER;
+    binsem_up(&(m->sem));
+    return 0;
+}
+
+void ut_mutex_get_stats(ut_mutex_t *m, binsem_stats_t *stats){
+    binsem_get_stats(&(m->sem), stats);
+}
+
+int ut_mutex_profile_add(ut_mutex_t *m, const char *name){
+    return binsem_profile_add(&(m->sem), name);
+}
+
+void ut_mutex_profile_remove(ut_mutex_t *m){
+    binsem_profile_remove(&(m->sem));
+}
+
+void ut_cond_init(ut_cond_t *c){
+    c->head = c->tail = NULL;
+}
+
+static void cond_unlink(ut_cond_t *c, cond_waiter_t *w){
+    cond_waiter_t *p, *prev;
+    for (prev = NULL, p = c->head; p && p != w; prev = p, p = p->next)
+        ;
+    if (!p)
+        return;
+    if (prev)
+        prev->next = w->next;
+    else
+        c->head = w->next;
+    if (c->tail == w)
+        c->tail = prev;
+}
+
+/*
+ * the waiter is queued before the mutex is unlocked, and both take place
+ * with the scheduler lock held, so a signal sent by a thread which locked
+ * the mutex afterwards cannot be missed. a cancel request is consumed by the
+ * wait, so locking the mutex again cannot be canceled as well, but one that
+ * arrives meanwhile is reported instead of being lost. a waiter that was
+ * signaled reports the signal, and leaves a cancel request that came with
+ * it pending for the next cancellation point.
+ */
+static int cond_wait(ut_cond_t *c, ut_mutex_t *m, unsigned long long deadline){
+    cond_waiter_t w;
+    int ret = 0, lock, canceled = 0;
+    if (m->sem.value != 0 || m->sem.owner != ut_self())
+        return MUTEX_NOT_OWNER;
+    w.tid = ut_self();
+    w.signaled = 0;
+    w.next = NULL;
+    ut_sched_lock();
+    if (c->tail)
+        c->tail->next = &w;
+    else
+        c->head = &w;
+    c->tail = &w;
+    ut_mutex_unlock(m);
+    while (!w.signaled && (ret = ut_park_until(deadline)) == 0)
+        ;
+    if (w.signaled){
+        canceled = (ret == UT_CANCELED);
+        ret = 0;
+    }
+    else
+        cond_unlink(c, &w);
+    ut_sched_unlock();
+    while ((lock = ut_mutex_lock(m)) == UT_CANCELED)
+        ret = UT_CANCELED;
+    if (canceled && ret == 0){
+        ut_sched_lock();
+        ut_cancel_restore();
+        ut_sched_unlock();
+    }
+    return (lock == SYS_ERR) ? SYS_ERR : ret;
+}
+
+int ut_cond_wait(ut_cond_t *c, ut_mutex_t *m){
+    return cond_wait(c, m, 0);
+}
+
+int ut_cond_timedwait(ut_cond_t *c, ut_mutex_t *m, unsigned long usec){
+    return cond_wait(c, m, ut_clock() + usec * 1000ULL);
+}
+
+void ut_cond_signal(ut_cond_t *c){
+    cond_waiter_t *w;
+    ut_sched_lock();
+    if ((w = c->head)){
+        if (!(c->head = w->next))
+            c->tail = NULL;
+        w->signaled = 1;
+        ut_unpark(w->tid);
+    }
+    ut_sched_unlock();
+}
+
+void ut_cond_broadcast(ut_cond_t *c){
+    cond_waiter_t *w;
+    ut_sched_lock();
+    for (w = c->head; w; w = w->next){
+        w->signaled = 1;
+        ut_unpark(w->tid);
+    }
+    c->head = c->tail = NULL;
+    ut_sched_unlock();
+}
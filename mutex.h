@@ -0,0 +1,144 @@
+/*****************************************************************************
+   File:        mutex.h
+
+   Description: this file defines mutexes for user-level threads. A mutex is
+                a binary semaphore which is initially raised and which only
+                the thread that locked it may unlock. It waits just like
+                binsem_down(): it adaptively spins while the owner is ready to
+                run, and then parks in the scheduler.
+                It also defines condition variables, which wait with a mutex.
+ ****************************************************************************/
+#ifndef _MUTEX_H
+#define _MUTEX_H
+
+#include "binsem.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MUTEX_BUSY -5      // the mutex is locked by another thread.
+#define MUTEX_NOT_OWNER -6 // the calling thread does not hold the mutex.
+
+/*****************************************************************************
+  The mutex type definition.
+*****************************************************************************/
+typedef struct ut_mutex {
+  sem_t sem;
+} ut_mutex_t;
+
+/*****************************************************************************
+  Initializes a mutex to the unlocked state.
+  Parameters:
+    m - pointer to the mutex to be initialized.
+*****************************************************************************/
+void ut_mutex_init(ut_mutex_t *m);
+
+/*****************************************************************************
+  Locks a mutex, waiting while another thread holds it. The mutex is not
+  recursive.
+  Parameters:
+    m - pointer to the mutex.
+  Returns:
+    0 - on success.
+    SYS_ERR - if the calling thread should wait while the scheduler is not
+    running.
+    UT_CANCELED - if the calling thread was canceled (see ut_cancel).
+*****************************************************************************/
+int ut_mutex_lock(ut_mutex_t *m);
+
+/*****************************************************************************
+  Locks a mutex, giving up after a timeout.
+  Parameters:
+    m - pointer to the mutex.
+    usec - the longest time to wait, in microseconds.
+  Returns:
+    the same as ut_mutex_lock(), or UT_TIMEDOUT if the mutex could not be
+    locked in time.
+*****************************************************************************/
+int ut_mutex_timedlock(ut_mutex_t *m, unsigned long usec);
+
+/*****************************************************************************
+  Locks a mutex if no thread holds it.
+  Parameters:
+    m - pointer to the mutex.
+  Returns:
+    0 - on success.
+    MUTEX_BUSY - if the mutex is already locked.
+*****************************************************************************/
+int ut_mutex_trylock(ut_mutex_t *m);
+
+/*****************************************************************************
+  Unlocks a mutex, releasing the first thread waiting for it.
+  Parameters:
+    m - pointer to the mutex.
+  Returns:
+    0 - on success.
+    MUTEX_NOT_OWNER - if the calling thread does not hold the mutex.
+*****************************************************************************/
+int ut_mutex_unlock(ut_mutex_t *m);
+
+/*****************************************************************************
+  Reads the waiting statistics of a mutex (see binsem.h).
+*****************************************************************************/
+void ut_mutex_get_stats(ut_mutex_t *m, binsem_stats_t *stats);
+
+/*****************************************************************************
+  Adds a mutex to (or removes it from) the contention profile of the
+  semaphores, which binsem_profile_report() prints (see binsem.h).
+*****************************************************************************/
+int ut_mutex_profile_add(ut_mutex_t *m, const char *name);
+void ut_mutex_profile_remove(ut_mutex_t *m);
+
+struct cond_waiter;
+
+/*****************************************************************************
+  The condition variable type definition. The fields are private to mutex.c.
+*****************************************************************************/
+typedef struct ut_cond {
+  struct cond_waiter *head, *tail; // the waiting threads, in arrival order.
+} ut_cond_t;
+
+/*****************************************************************************
+  Initializes a condition variable with no waiting thread.
+  Parameters:
+    c - pointer to the condition variable to be initialized.
+*****************************************************************************/
+void ut_cond_init(ut_cond_t *c);
+
+/*****************************************************************************
+  Unlocks a mutex and waits on a condition variable, as one step, and locks
+  the mutex again before returning (whatever the result). The wait may end
+  without a signal, so the caller should check its condition in a loop.
+  Parameters:
+    c - pointer to the condition variable.
+    m - pointer to the mutex, which the calling thread holds.
+  Returns:
+    0 - on success.
+    MUTEX_NOT_OWNER - if the calling thread does not hold the mutex.
+    UT_CANCELED - if the calling thread was canceled (see ut_cancel).
+    SYS_ERR - if the calling thread should wait while the scheduler is not
+    running.
+*****************************************************************************/
+int ut_cond_wait(ut_cond_t *c, ut_mutex_t *m);
+
+/*****************************************************************************
+  Like ut_cond_wait(), but returns UT_TIMEDOUT if no signal came after usec
+  microseconds.
+*****************************************************************************/
+int ut_cond_timedwait(ut_cond_t *c, ut_mutex_t *m, unsigned long usec);
+
+/*****************************************************************************
+  Wakes up the first thread waiting on a condition variable (ut_cond_signal)
+  or all of them (ut_cond_broadcast). Has no effect if none waits.
+  Parameters:
+    c - pointer to the condition variable.
+*****************************************************************************/
+void ut_cond_signal(ut_cond_t *c);
+void ut_cond_broadcast(ut_cond_t *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -13,6 +13,7 @@
 #include <inttypes.h>
 
 #include "binsem.h"
+#include "trace.h"
 #include "ut.h"
 
 
@@ -25,6 +26,17 @@
 
 int N;
 
+/* benchmark mode (-b): the philosophers run for a fixed duration without
+   printing, and the meals and waiting times are summarized at the end. */
+int bench = 0;
+long think_work = 100000000;
+long eat_work = 100000000;
+double duration = 5;
+uint64_t end_time;
+long *meals;
+uint64_t *hungry_since;
+uint64_t *max_starve;
+
 volatile int *phil_state;
 sem_t *s;
 sem_t mutex;
@@ -40,29 +52,49 @@ uint64_t get_wall_time() {
  return millis;
 }
 
+uint64_t get_time_us() {
+ struct timeval time;
+
+ gettimeofday(&time, NULL);
+ return (time.tv_sec * (uint64_t)1000000) + time.tv_usec;
+}
+
 void think(int p) {
-  int i, factor;
+  long i, factor;
   volatile int j;
 
-  printf("Philosopher (%d) - time %" PRId64 " - is thinking\n",p, get_wall_time()); fflush (stdout);
+  if (!bench){
+    printf("Philosopher (%d) - time %" PRId64 " - is thinking\n",p, get_wall_time()); fflush (stdout);
+  }
 
   factor = 1 + random()%5;
 
-  for (i = 0; i < 100000000*factor; i++){
+  for (i = 0; i < think_work*factor; i++){
     j += (int) i*i;
   }
 
-  printf("Philosopher (%d) - time %" PRId64 " - is hungry\n", p, get_wall_time()); fflush (stdout);
+  if (!bench){
+    printf("Philosopher (%d) - time %" PRId64 " - is hungry\n", p, get_wall_time()); fflush (stdout);
+  }
 }
 
 void eat(int p){
-  int i, factor;
+  long i, factor;
   volatile int j;
+  uint64_t waited;
 
-   printf("Philosopher (%d) - time %" PRId64 " - is eating\n",p, get_wall_time()); fflush (stdout);
+   if (bench){
+     waited = get_time_us() - hungry_since[p];
+     if (waited > max_starve[p])
+       max_starve[p] = waited;
+     meals[p]++;
+   }
+   else{
+     printf("Philosopher (%d) - time %" PRId64 " - is eating\n",p, get_wall_time()); fflush (stdout);
+   }
 
    factor = 1 + random()%5;
-   for (i = 0; i < 100000000*factor; i++){
+   for (i = 0; i < eat_work*factor; i++){
       j += (int) i*i;
    }
    //printf("Philosopher (%d) - time %" PRId64 " - is thinking\n",p, get_wall_time()); fflush (stdout);
@@ -79,6 +111,9 @@ void test(int i){
 }
 
 void take_forks(int i){
+  if (bench)
+    hungry_since[i] = get_time_us();
+
   binsem_down(&mutex);
 
   phil_state[i] = HUNGRY;
@@ -114,8 +149,10 @@ void int_handler(int signo) {
   exit(0);
 }
 
+/* in benchmark mode a philosopher leaves the table once the duration is
+   over, so ut_start() returns after the last one leaves. */
 void philosopher(int i){
-  while (1){
+  while (!bench || get_time_us() < end_time){
     think(i);
     take_forks(i);
     eat(i);
@@ -123,25 +160,85 @@ void philosopher(int i){
   }
 }
 
+void usage(char *prog) {
+  printf("Usage: %s [-b] [-d seconds] [-t think_work] [-e eat_work] [-q quantum_usec]\n"
+         "          [-T trace_file] N (N >=2)\n"
+         "  -b runs in benchmark mode: no output until the duration (-d, default 5\n"
+         "     seconds) is over, then a summary of the meals is printed.\n"
+         "  -t and -e set the busy-loop iterations of thinking and eating\n"
+         "     (default 100000000, times a random factor of 1 to 5).\n"
+         "  -q sets the scheduler's quantum (default 1 second).\n"
+         "  -T records a trace of the scheduler to trace_file once the benchmark\n"
+         "     mode run is over (see trace2json).\n", prog);
+  exit(1);
+}
+
+/* prints the benchmark mode summary. Jain's fairness index of the meals is
+   (sum of meals)^2 / (N * sum of squared meals): 1 when every philosopher ate
+   the same number of meals, down to 1/N when a single philosopher ate them
+   all. the starvation interval is the time from getting hungry to eating. */
+void bench_report(uint64_t start, unsigned long switches) {
+  double elapsed = (get_time_us() - start) / 1e6, sum = 0, sumsq = 0;
+  long min = meals[0], max = meals[0];
+  uint64_t starve = 0;
+  int i, starved = 0;
+
+  for (i = 0; i < N; i++) {
+    sum += meals[i];
+    sumsq += (double)meals[i] * meals[i];
+    if (meals[i] < min) min = meals[i];
+    if (meals[i] > max) max = meals[i];
+    if (max_starve[i] > starve) {
+      starve = max_starve[i];
+      starved = i;
+    }
+  }
+  printf("Philosophers: %d, duration: %.2f sec\n", N, elapsed);
+  printf("Total meals: %.0f (%.1f meals/sec), per philosopher: min %ld, max %ld\n",
+         sum, sum / elapsed, min, max);
+  printf("Jain's fairness index: %.4f\n", sumsq > 0 ? sum * sum / (N * sumsq) : 0);
+  printf("Max starvation interval: %.3f ms (philosopher %d)\n", starve / 1000.0, starved + 1);
+  printf("Context switches: %lu (%.1f/sec)\n", switches, switches / elapsed);
+  printf("\n");
+  binsem_profile_report(stdout);
+}
+
 int main(int argc, char *argv[])
 {
   int c;
-  if (argc != 2){
-    printf("Usage: %s N\n", argv[0]);
-    exit(1);
+  unsigned long quantum = 0;
+  char *trace_path = NULL;
+  uint64_t start;
+
+  while ((c = getopt(argc, argv, "bd:t:e:q:T:")) != -1) {
+    switch (c) {
+    case 'b': bench = 1; break;
+    case 'd': duration = atof(optarg); break;
+    case 't': think_work = atol(optarg); break;
+    case 'e': eat_work = atol(optarg); break;
+    case 'q': quantum = strtoul(optarg, NULL, 10); break;
+    case 'T': trace_path = optarg; break;
+    default: usage(argv[0]);
+    }
   }
 
-  N = atoi(argv[1]);
+  if (optind != argc - 1)
+    usage(argv[0]);
 
-  if (N < 2){
-    printf("Usage: %s N (N >=2)\n", argv[0]);
-    exit(1);
-  }
+  N = atoi(argv[optind]);
+
+  if (N < 2 || N > MAX_TAB_SIZE || duration <= 0 || think_work < 0 || eat_work < 0)
+    usage(argv[0]);
 
   ut_init(N);
-  s = (sem_t *)malloc (N * sizeof(sem_t));
-  phil_state = (int *) malloc (N * sizeof(int));
-  tid = (int *) malloc (N * sizeof(int));
+  s = (sem_t *) ut_alloc (N * sizeof(sem_t));
+  phil_state = (int *) ut_alloc (N * sizeof(int));
+  tid = (int *) ut_alloc (N * sizeof(int));
+  meals = (long *) ut_alloc (N * sizeof(long));
+  hungry_since = (uint64_t *) ut_alloc (N * sizeof(uint64_t));
+  max_starve = (uint64_t *) ut_alloc (N * sizeof(uint64_t));
+  if (quantum)
+    ut_set_quantum(quantum);
 
   for (c = 0; c < N ; c++){
     phil_state[c] = THINKING;
@@ -150,14 +247,38 @@ int main(int argc, char *argv[])
 
   for (c = 0; c < N ; c++){
     tid[c] = ut_spawn_thread(philosopher,c);
-    printf("Spawned thread #%d\n", tid[c]);
+    if (!bench)
+      printf("Spawned thread #%d\n", tid[c]);
   }
 
   binsem_init(&mutex, 1);
 
+  if (bench){
+    char name[32];
+    binsem_profile_add(&mutex, "mutex");
+    for (c = 0; c < N ; c++){
+      sprintf(name, "s[%d]", c);
+      binsem_profile_add(&(s[c]), name);
+    }
+  }
+
   signal(SIGINT,int_handler);
+  if (trace_path && ut_trace_start(1 << 20) == SYS_ERR)
+    trace_path = NULL;
+
+  start = get_time_us();
+  end_time = start + (uint64_t)(duration * 1e6);
   ut_start();
 
+  if (bench)
+    bench_report(start, ut_get_switches());
+
+  if (trace_path){
+    if (ut_trace_dump(trace_path) == SYS_ERR)
+      perror(trace_path);
+    ut_trace_stop();
+  }
+
   return 0; // avoid warnings
 
 }
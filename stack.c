@@ -0,0 +1,99 @@
+/*****************************************************************************
+This file implements the thread stacks allocator. A mapped stack is reserved
+with MAP_NORESERVE, so a large stack costs no memory (nor swap reservation)
+until it is used, and its lowest page is made inaccessible as a guard page.
+ ****************************************************************************/
+#define _GNU_SOURCE /*for MAP_NORESERVE and MAP_STACK*/
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "stack.h"
+#include "ut.h"
+
+#define STACK_ALIGN UT_CACHE_LINE /*the alignment of a stack in the arena*/
+
+static size_t page_size(void){
+    static size_t size = 0;
+    if (!size)
+        size = (size_t)sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+static char *page_floor(char *p){
+    return (char *)((unsigned long)p & ~(unsigned long)(page_size() - 1));
+}
+
+void *ut_stack_alloc(ut_arena_t *arena, size_t size, int flags){
+    char *base;
+    if (!(flags & UT_STACK_MMAP))
+        return ut_arena_alloc(arena, size, STACK_ALIGN);
+    base = (char *)mmap(NULL, size + page_size(), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (mprotect(base, page_size(), PROT_NONE) == -1){
+        munmap(base, size + page_size());
+        return NULL;
+    }
+    return base + page_size();
+}
+
+void ut_stack_free(ut_arena_t *arena, void *stack, size_t size, int flags){
+    if (!stack)
+        return;
+    if (flags & UT_STACK_MMAP)
+        munmap((char *)stack - page_size(), size + page_size());
+    else
+        ut_arena_free(arena, stack, size);
+}
+
+void ut_stack_release(void *stack, void *below){
+    char *end = page_floor((char *)below);
+    if (end > (char *)stack)
+        madvise(stack, end - (char *)stack, MADV_DONTNEED);
+}
+
+/*
+ * checks the pages from the bottom of the stack up, since mincore() reports
+ * on a whole range at once and the stack is at most a few MB.
+ */
+size_t ut_stack_resident(void *stack, size_t size){
+    size_t pages = size / page_size(), i;
+    unsigned char vec[256];
+    size_t chunk, j;
+    for (i = 0; i < pages; i += chunk){
+        chunk = (pages - i < sizeof(vec)) ? pages - i : sizeof(vec);
+        if (mincore((char *)stack + i * page_size(), chunk * page_size(), vec) == -1)
+            return 0;
+        for (j = 0; j < chunk; j++)
+            if (vec[j] & 1)
+                return size - (i + j) * page_size();
+    }
+    return 0;
+}
+
+/*
+ * a stack of the arena need not start or end on a page, so only the part of
+ * its first and last pages it covers is counted.
+ */
+size_t ut_stack_committed(void *stack, size_t size){
+    char *start = (char *)stack, *end = start + size;
+    char *p = page_floor(start), *lo, *hi;
+    unsigned char vec[256];
+    size_t chunk, j, bytes = 0;
+    while (p < end){
+        chunk = (end - p + page_size() - 1) / page_size();
+        if (chunk > sizeof(vec))
+            chunk = sizeof(vec);
+        if (mincore(p, chunk * page_size(), vec) == -1)
+            return 0;
+        for (j = 0; j < chunk; j++, p += page_size()){
+            if (!(vec[j] & 1))
+                continue;
+            lo = (p < start) ? start : p;
+            hi = (p + page_size() > end) ? end : p + page_size();
+            bytes += hi - lo;
+        }
+    }
+    return bytes;
+}
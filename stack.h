@@ -0,0 +1,68 @@
+/*****************************************************************************
+   File:        stack.h
+
+   Description: this file defines the thread stacks allocator used by the
+                user-level threads library. These are not meant to be called
+                by the threads' own code; the stacks are set up through
+                ut_set_stack_policy() and ut_set_stack_alloc() (see ut.h).
+
+                A stack is either a block of an arena (see arena.h), or a
+                mapping of its own which is only reserved: the kernel commits
+                its pages as they are first touched, and a guard page below
+                the stack turns an overflow into a fault instead of a silent
+                corruption.
+ ****************************************************************************/
+#ifndef _STACK_H
+#define _STACK_H
+
+#include <stddef.h>
+
+#include "arena.h"
+
+/*****************************************************************************
+ Allocates a stack.
+
+ Parameters:
+    size - the usable size of the stack, in bytes (a multiple of the page
+    size for a mapped stack).
+    arena - the arena a stack which is not mapped is allocated from.
+    flags - UT_STACK_MMAP for a mapped stack, or otherwise a block of the
+    arena.
+
+ Returns:
+    the lowest usable address of the stack, or NULL on failure.
+ ****************************************************************************/
+void *ut_stack_alloc(ut_arena_t *arena, size_t size, int flags);
+
+/*****************************************************************************
+ Frees a stack allocated by ut_stack_alloc() with the same size and flags (a
+ block of the arena is handed back to the arena, to be reused by a stack of
+ the same size).
+ ****************************************************************************/
+void ut_stack_free(ut_arena_t *arena, void *stack, size_t size, int flags);
+
+/*****************************************************************************
+ Gives the whole pages of a mapped stack below the given address back to the
+ kernel. They read as zeros the next time they are touched.
+
+ Parameters:
+    stack - the lowest usable address of the stack.
+    below - the pages wholly below this address are released.
+ ****************************************************************************/
+void ut_stack_release(void *stack, void *below);
+
+/*****************************************************************************
+ Returns the distance from the top of a mapped stack to the bottom of its
+ lowest resident page, which is the stack's peak usage (rounded up to a
+ page) as long as no page was released since.
+ ****************************************************************************/
+size_t ut_stack_resident(void *stack, size_t size);
+
+/*****************************************************************************
+ Returns the bytes of a stack that are resident in memory, whether it is
+ mapped or a block of the arena. A page backed by a huge page is resident as
+ soon as any part of the huge page was touched.
+ ****************************************************************************/
+size_t ut_stack_committed(void *stack, size_t size);
+
+#endif
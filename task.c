@@ -0,0 +1,173 @@
+/*****************************************************************************
+This file implements task groups on top of the scheduler hooks (see
+ut_sched.h). A task is spawned with a header before its argument on its
+stack, naming its function and group.
+ ****************************************************************************/
+#include <string.h>
+
+#include "task.h"
+#include "ut_sched.h"
+
+#define DEFAULT_PARTS 64 /*the parts ut_parallel_for() splits a range into by default*/
+
+/*
+ * a thread waiting for a group, kept on the stack of the waiting thread.
+ */
+typedef struct task_waiter {
+    tid_t tid;
+    struct task_waiter *next;
+} task_waiter_t;
+
+/*
+ * what a task finds at the top of its stack, followed by its argument. the
+ * header is padded to 32 bytes, so the argument stays 16-byte aligned.
+ */
+typedef struct task_head {
+    void (*fn)(void *);
+    ut_task_group_t *group;
+    char pad[32 - sizeof(void (*)(void *)) - sizeof(ut_task_group_t *)];
+} task_head_t;
+
+_Static_assert(sizeof(task_head_t) == 32, "UT_TASK_MAX_ARG assumes a 32 byte header");
+
+typedef struct task_init {
+    task_head_t head;
+    const void *arg;
+    size_t size;
+} task_init_t;
+
+/*
+ * a part of a ut_parallel_for() range, the argument of its task.
+ */
+typedef struct range {
+    ut_task_group_t *group;
+    long begin, end, grain;
+    void (*fn)(long, long, void *);
+    void *ctx;
+} range_t;
+
+void ut_task_group_init(ut_task_group_t *g){
+    g->pending = 0;
+    g->waiters = NULL;
+}
+
+/*
+ * ends a task of the group, unparking the waiters with the last one.
+ */
+static void task_done(ut_task_group_t *g){
+    task_waiter_t *w;
+    ut_sched_lock();
+    if (--g->pending == 0){
+        for (w = g->waiters; w; w = w->next)
+            ut_unpark(w->tid);
+        g->waiters = NULL;
+    }
+    ut_sched_unlock();
+}
+
+static void task_run(void *place){
+    task_head_t *head = (task_head_t *)place;
+    head->fn((char *)place + sizeof(task_head_t));
+    task_done(head->group);
+}
+
+static void task_place(void *place, void *ctx){
+    task_init_t *init = (task_init_t *)ctx;
+    memcpy(place, &(init->head), sizeof(task_head_t));
+    memcpy((char *)place + sizeof(task_head_t), init->arg, init->size);
+}
+
+/*
+ * the task is counted before it is spawned, since it may return before the
+ * spawning thread runs again.
+ */
+int ut_task_group_spawn(ut_task_group_t *g, void (*fn)(void *), const void *arg, size_t size){
+    task_init_t init;
+    tid_t tid;
+    if (size > UT_TASK_MAX_ARG)
+        return SYS_ERR;
+    init.head.fn = fn;
+    init.head.group = g;
+    init.arg = arg;
+    init.size = size;
+    ut_sched_lock();
+    g->pending++;
+    tid = ut_spawn_emplace(task_run, sizeof(task_head_t) + size, task_place, &init, NULL);
+    if (tid < 0)
+        g->pending--;
+    ut_sched_unlock();
+    if (tid == TAB_FULL){
+        fn((void *)arg);
+        return 0;
+    }
+    return (tid < 0) ? SYS_ERR : 0;
+}
+
+int ut_task_group_wait(ut_task_group_t *g){
+    task_waiter_t w, **p;
+    int ret = 0;
+    ut_sched_lock();
+    while (g->pending > 0 && ret == 0){
+        w.tid = ut_self();
+        w.next = g->waiters;
+        g->waiters = &w;
+        ret = ut_park();
+        for (p = &(g->waiters); *p; p = &((*p)->next))
+            if (*p == &w){
+                *p = w.next;
+                break;
+            }
+    }
+    ut_sched_unlock();
+    return ret;
+}
+
+static void range_task(void *arg); /*see below*/
+
+/*
+ * splits off the upper halves of the range as tasks, and runs the lowest
+ * part in the calling thread.
+ */
+static void range_split(range_t *r){
+    range_t upper;
+    long begin = r->begin, end = r->end, mid;
+    while (end - begin > r->grain){
+        mid = begin + (end - begin) / 2;
+        upper = *r;
+        upper.begin = mid;
+        upper.end = end;
+        if (ut_task_group_spawn(r->group, range_task, &upper, sizeof(upper)) != 0)
+            break;
+        end = mid;
+    }
+    r->fn(begin, end, r->ctx);
+}
+
+static void range_task(void *arg){
+    range_split((range_t *)arg);
+}
+
+/*
+ * the caller splits the range like any task would, so the first part runs
+ * without a thread of its own.
+ */
+int ut_parallel_for(long begin, long end, long grain,
+                    void (*fn)(long begin, long end, void *ctx), void *ctx){
+    ut_task_group_t g;
+    range_t r;
+    if (begin >= end)
+        return 0;
+    if (!ut_in_scheduler())
+        return SYS_ERR;
+    if (grain <= 0 && (grain = (end - begin) / DEFAULT_PARTS) == 0)
+        grain = 1;
+    ut_task_group_init(&g);
+    r.group = &g;
+    r.begin = begin;
+    r.end = end;
+    r.grain = grain;
+    r.fn = fn;
+    r.ctx = ctx;
+    range_split(&r);
+    return ut_task_group_wait(&g);
+}
@@ -0,0 +1,98 @@
+/*****************************************************************************
+   File:        task.h
+
+   Description: this file defines task groups and a parallel loop for
+                user-level threads. A task group counts the tasks spawned
+                into it (each a thread of its own, with its argument copied
+                onto its stack), and ut_task_group_wait() parks until every
+                one of them returned. ut_parallel_for() splits a range of
+                indices in halves recursively, down to a grain, and runs
+                every part as a task of one group: a task that gets a range
+                spawns its upper half and keeps splitting the lower one, so
+                the range is split by many threads at once instead of being
+                partitioned up front by the caller.
+                All the threads run on the scheduler's single kernel thread,
+                so the parts of a loop interleave (by the quantum) rather
+                than run in parallel; the split still bounds how long any
+                part runs, and lets a loop of blocking steps overlap them.
+ ****************************************************************************/
+#ifndef _TASK_H
+#define _TASK_H
+
+#include <stddef.h>
+
+#include "ut.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UT_TASK_MAX_ARG (UT_MAX_PAYLOAD - 32) // the largest argument a task copies.
+
+struct task_waiter;
+
+/*****************************************************************************
+  The task group type definition. The fields are private to task.c.
+*****************************************************************************/
+typedef struct ut_task_group {
+  int pending;                     // the tasks which have not returned yet.
+  struct task_waiter *waiters;     // the threads parked in ut_task_group_wait().
+} ut_task_group_t;
+
+/*****************************************************************************
+  Initializes an empty task group.
+  Parameters:
+    g - pointer to the group to be initialized.
+*****************************************************************************/
+void ut_task_group_init(ut_task_group_t *g);
+
+/*****************************************************************************
+  Spawns a task into a group: a detached thread running fn with a pointer to
+  a copy of the argument (see ut_spawn_copy()). If the threads table is full,
+  the calling thread runs the task itself before returning, so a group never
+  fails for want of slots.
+  Parameters:
+    g - pointer to the group.
+    fn - the function of the task.
+    arg - the argument to copy, of size bytes (at most UT_TASK_MAX_ARG).
+    size - the size of the argument.
+  Returns:
+    0 - on success.
+    SYS_ERR - on system failure, or if the argument is too large.
+*****************************************************************************/
+int ut_task_group_spawn(ut_task_group_t *g, void (*fn)(void *), const void *arg, size_t size);
+
+/*****************************************************************************
+  Waits until every task spawned into a group returned (including the tasks
+  they spawned into it in turn).
+  Parameters:
+    g - pointer to the group.
+  Returns:
+    0 - on success.
+    SYS_ERR - if the calling thread should wait while the scheduler is not
+    running.
+*****************************************************************************/
+int ut_task_group_wait(ut_task_group_t *g);
+
+/*****************************************************************************
+  Calls fn on every part of the range [begin, end), split into parts of at
+  most grain indices, and returns once every call returned. The calls are
+  made by tasks of one group (see above), and their order is unspecified.
+  Parameters:
+    begin, end - the range.
+    grain - the largest part of the range a single call gets, or 0 (or less)
+    to split the range into 64 parts.
+    fn - called with the bounds of a part, and ctx.
+    ctx - passed to fn.
+  Returns:
+    0 - on success.
+    SYS_ERR - on system failure, or if the scheduler is not running.
+*****************************************************************************/
+int ut_parallel_for(long begin, long end, long grain,
+                    void (*fn)(long begin, long end, void *ctx), void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
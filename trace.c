@@ -0,0 +1,108 @@
+/*****************************************************************************
+This file implements the trace recorder. The ring buffer only ever has a
+single writer, the scheduler's kernel thread with the scheduler lock held, so
+a record is appended with plain stores. The timestamp frequency is measured
+against the monotonic clock between the start of the recording and the dump.
+ ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include "trace.h"
+#include "ut_sched.h"
+
+#define TRACE_MIN_EVENTS 1024
+
+int ut_trace_on = 0;
+static ut_trace_rec_t *ring = NULL;
+static unsigned long ring_mask;         /*the ring size minus 1*/
+static unsigned long long ring_head;    /*the number of records ever appended*/
+static unsigned long long start_tsc;    /*the timestamp and the clock at the start,*/
+static unsigned long long start_ns;     /*for measuring the timestamp frequency*/
+
+static unsigned long long clock_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * the timestamp of a record. elsewhere than on x86 the monotonic clock is
+ * used, so the frequency comes out as 1GHz.
+ */
+static unsigned long long trace_clock(void){
+#if defined(__i386__) || defined(__x86_64__)
+    return __rdtsc();
+#else
+    return clock_ns();
+#endif
+}
+
+int ut_trace_start(unsigned long events){
+    unsigned long size = TRACE_MIN_EVENTS;
+    ut_trace_rec_t *buf;
+    while (size < events)
+        size *= 2;
+    if (!(buf = (ut_trace_rec_t *)malloc(size * sizeof(ut_trace_rec_t))))
+        return SYS_ERR;
+    ut_trace_stop();
+    ring = buf;
+    ring_mask = size - 1;
+    ring_head = 0;
+    start_ns = clock_ns();
+    start_tsc = trace_clock();
+    ut_trace_on = 1;
+    return 0;
+}
+
+void ut_trace_record(int type, int tid, int arg){
+    ut_trace_rec_t *rec = &(ring[ring_head & ring_mask]);
+    rec->tsc = trace_clock();
+    rec->arg = arg;
+    rec->tid = tid;
+    rec->type = type;
+    rec->reserved = 0;
+    ring_head++;
+}
+
+/*
+ * behaves as described in the header. the recording is paused while the
+ * buffer is written, so the records written are the ones recorded up to the
+ * call.
+ */
+int ut_trace_dump(const char *path){
+    ut_trace_header_t header;
+    unsigned long long first, i, ns;
+    int on = ut_trace_on, ret = 0;
+    FILE *f;
+    if (!ring)
+        return SYS_ERR;
+    if (!(f = fopen(path, "wb")))
+        return SYS_ERR;
+    ut_trace_on = 0;
+    ns = clock_ns() - start_ns;
+    memcpy(header.magic, UT_TRACE_MAGIC, sizeof(header.magic));
+    header.tsc_hz = ns ? (unsigned long long)((trace_clock() - start_tsc) * 1e9 / ns) : 0;
+    first = (ring_head > ring_mask + 1) ? ring_head - (ring_mask + 1) : 0;
+    header.count = ring_head - first;
+    header.lost = first;
+    if (fwrite(&header, sizeof(header), 1, f) != 1)
+        ret = SYS_ERR;
+    for (i = first; ret == 0 && i < ring_head; i++)
+        if (fwrite(&(ring[i & ring_mask]), sizeof(ut_trace_rec_t), 1, f) != 1)
+            ret = SYS_ERR;
+    if (fclose(f) != 0)
+        ret = SYS_ERR;
+    ut_trace_on = on;
+    return ret;
+}
+
+void ut_trace_stop(void){
+    ut_trace_on = 0;
+    free(ring);
+    ring = NULL;
+}
@@ -0,0 +1,99 @@
+/*****************************************************************************
+   File:        trace.h
+
+   Description: this file defines the scheduler's trace recorder. Once
+                started, the scheduler records its events (switches, parking
+                and unparking, spawns, exits and semaphore waits) in a ring
+                buffer in memory, each with a processor timestamp (the TSC on
+                x86). The buffer is written to a file on demand, in the
+                binary format below, and trace2json converts such a file to
+                the Chrome trace-event JSON format, to be viewed in a trace
+                viewer (like Perfetto or chrome://tracing).
+                While the recorder is stopped, every event costs a single
+                check of a flag.
+ ****************************************************************************/
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "ut.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The event types. */
+#define UT_TRACE_SWITCH   1 // tid starts running, arg gave up the processor by itself.
+#define UT_TRACE_PREEMPT  2 // tid starts running, arg was preempted.
+#define UT_TRACE_BLOCK    3 // tid parks.
+#define UT_TRACE_WAKE     4 // tid is unparked by arg.
+#define UT_TRACE_SPAWN    5 // tid is spawned by arg (-1 if spawned before ut_start).
+#define UT_TRACE_EXIT     6 // tid exits.
+#define UT_TRACE_SEM_WAIT 7 // tid waits on the semaphore arg.
+#define UT_TRACE_SEM_POST 8 // tid releases the semaphore arg to a waiting thread.
+
+#define UT_TRACE_MAGIC "UTTRACE1"
+
+/*****************************************************************************
+  A trace file is a header followed by count records, oldest first.
+    magic - UT_TRACE_MAGIC (without the terminating null).
+    tsc_hz - the number of timestamp ticks per second.
+    count - the number of records in the file.
+    lost - the number of older records overwritten in the ring buffer.
+*****************************************************************************/
+typedef struct ut_trace_header {
+  char magic[8];
+  unsigned long long tsc_hz;
+  unsigned long long count;
+  unsigned long long lost;
+} ut_trace_header_t;
+
+/*****************************************************************************
+  A single trace record (16 bytes).
+    tsc - the timestamp of the event.
+    arg - depends on the type (see the event types above). A semaphore is
+    identified by the low 32 bits of its address.
+    tid - the thread the event is about.
+    type - the event type.
+*****************************************************************************/
+typedef struct ut_trace_rec {
+  unsigned long long tsc;
+  int arg;
+  short tid;
+  unsigned char type;
+  unsigned char reserved;
+} ut_trace_rec_t;
+
+/*****************************************************************************
+  Starts recording, in a new ring buffer which keeps the last events.
+  Parameters:
+    events - the size of the ring buffer, in records (rounded up to a power of
+    two, and to at least 1024).
+  Returns:
+    0 - on success.
+    SYS_ERR - on allocation failure.
+*****************************************************************************/
+int ut_trace_start(unsigned long events);
+
+/*****************************************************************************
+  Writes the recorded events to a file. Must be called by the kernel thread
+  running the scheduler (from a user-level thread, or once ut_start()
+  returned), and before ut_trace_stop().
+  Parameters:
+    path - the file to write.
+  Returns:
+    0 - on success.
+    SYS_ERR - if the recorder was not started, or the file could not be
+    written.
+*****************************************************************************/
+int ut_trace_dump(const char *path);
+
+/*****************************************************************************
+  Stops recording and frees the ring buffer.
+*****************************************************************************/
+void ut_trace_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
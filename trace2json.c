@@ -0,0 +1,133 @@
+/*****************************************************************************
+Trace converter:
+this file converts a trace file written by ut_trace_dump() to the Chrome
+trace-event JSON format. every user-level thread gets a track of its own, on
+which the periods it ran are drawn as slices (named after how they ended),
+and the other events are drawn as instant events.
+ ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define MAX_TIDS 32768
+
+static const char *event_names[] = {
+  NULL, "switch", "preempt", "block", "wake", "spawn", "exit", "sem_wait", "sem_post"
+};
+
+static double tsc_to_us;
+static unsigned long long first_tsc;
+static unsigned long long run_since[MAX_TIDS]; /*when each running thread started to run*/
+static char running[MAX_TIDS];
+static char named[MAX_TIDS];
+static int events_out = 0;
+
+static double us(unsigned long long tsc){
+  return (tsc - first_tsc) * tsc_to_us;
+}
+
+static void begin_event(FILE *out){
+  fprintf(out, events_out++ ? ",\n" : "\n");
+}
+
+static void name_thread(FILE *out, int tid){
+  if (tid < 0 || tid >= MAX_TIDS || named[tid])
+    return;
+  named[tid] = 1;
+  begin_event(out);
+  fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+          "\"args\":{\"name\":\"ut thread %d\"}}", tid, tid);
+}
+
+/*
+ * ends the slice of a running thread, if it has one.
+ */
+static void end_run(FILE *out, int tid, unsigned long long tsc, const char *how){
+  if (tid < 0 || tid >= MAX_TIDS || !running[tid])
+    return;
+  running[tid] = 0;
+  begin_event(out);
+  fprintf(out, "{\"name\":\"run\",\"cat\":\"sched\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+          "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"end\":\"%s\"}}",
+          tid, us(run_since[tid]), us(tsc) - us(run_since[tid]), how);
+}
+
+static void start_run(int tid, unsigned long long tsc){
+  if (tid < 0 || tid >= MAX_TIDS)
+    return;
+  running[tid] = 1;
+  run_since[tid] = tsc;
+}
+
+static void instant(FILE *out, const ut_trace_rec_t *rec){
+  begin_event(out);
+  fprintf(out, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,"
+          "\"tid\":%d,\"ts\":%.3f,\"args\":{\"arg\":", event_names[rec->type],
+          rec->type >= UT_TRACE_SEM_WAIT ? "sem" : "sched", rec->tid, us(rec->tsc));
+  if (rec->type >= UT_TRACE_SEM_WAIT)
+    fprintf(out, "\"0x%08x\"}}", (unsigned int)rec->arg);
+  else
+    fprintf(out, "%d}}", rec->arg);
+}
+
+static void convert(FILE *in, FILE *out, const ut_trace_header_t *header){
+  ut_trace_rec_t rec;
+  unsigned long long last_tsc = first_tsc;
+  int tid;
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  while (fread(&rec, sizeof(rec), 1, in) == 1){
+    if (rec.type < UT_TRACE_SWITCH || rec.type > UT_TRACE_SEM_POST)
+      continue;
+    if (first_tsc == 0)
+      first_tsc = rec.tsc;
+    last_tsc = rec.tsc;
+    name_thread(out, rec.tid);
+    switch (rec.type){
+    case UT_TRACE_SWITCH:
+    case UT_TRACE_PREEMPT:
+      end_run(out, rec.arg, rec.tsc, event_names[rec.type]);
+      start_run(rec.tid, rec.tsc);
+      break;
+    case UT_TRACE_BLOCK:
+    case UT_TRACE_EXIT:
+      instant(out, &rec);
+      end_run(out, rec.tid, rec.tsc, event_names[rec.type]);
+      break;
+    default:
+      instant(out, &rec);
+    }
+  }
+  for (tid = 0; tid < MAX_TIDS; tid++)
+    end_run(out, tid, last_tsc, "end of trace");
+  fprintf(out, "\n],\"otherData\":{\"lost_events\":\"%llu\"}}\n", header->lost);
+}
+
+int main(int argc, char *argv[]){
+  ut_trace_header_t header;
+  FILE *in, *out = stdout;
+  if (argc != 2 && argc != 3){
+    fprintf(stderr, "Usage: %s trace_file [json_file]\n", argv[0]);
+    return 1;
+  }
+  if (!(in = fopen(argv[1], "rb"))){
+    perror(argv[1]);
+    return 1;
+  }
+  if (fread(&header, sizeof(header), 1, in) != 1 ||
+      memcmp(header.magic, UT_TRACE_MAGIC, sizeof(header.magic)) != 0 || header.tsc_hz == 0){
+    fprintf(stderr, "%s: not a trace file\n", argv[1]);
+    return 1;
+  }
+  if (argc == 3 && !(out = fopen(argv[2], "w"))){
+    perror(argv[2]);
+    return 1;
+  }
+  tsc_to_us = 1e6 / header.tsc_hz;
+  convert(in, out, &header);
+  fclose(in);
+  if (out != stdout)
+    fclose(out);
+  return 0;
+}
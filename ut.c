@@ -2,33 +2,128 @@
 User Threads:
 this file defines a simple library for creating & scheduling user-level threads.
  ****************************************************************************/
+#define _GNU_SOURCE /*for the register names of ucontext_t*/
+#include <linux/futex.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <ucontext.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <unistd.h>
+#if defined(__x86_64__) && defined(__linux__) && !defined(UT_SIGNAL_SWITCH)
+#include <cpuid.h>
+/*
+ * preempted threads switch outside of the signal handler (see below), unless
+ * the library is built with -DUT_SIGNAL_SWITCH to switch inside the handler
+ * as on other platforms (for comparing the two).
+ */
+#define PREEMPT_TRAMPOLINE
+#endif
 
+#include "atomic.h"
+#include "stack.h"
 #include "ut.h"
+#include "ut_sched.h"
 
-#define QUANTUM 1
+#define QUANTUM 1 /*the default time slice, in seconds*/
 #define INTERVAL_MILLI 100000
 #define INTERVAL_MICRO 100
+#define NO_THREAD -1
+#define STACK_PATTERN 0xa5       /*the byte new stacks are filled with for watermarking*/
+#define STACK_FUNCS 64           /*the functions whose stack usage is recorded*/
+#define STACK_SIGNAL_ROOM 4096   /*the room kept for a signal frame by the recommendation*/
+#define PAGE_SIZE 4096
+#define STACK_RELEASE_MARGIN PAGE_SIZE /*kept below a frame for the calls it makes*/
+#define STACK_KIND (UT_STACK_MMAP | UT_STACK_HUGE) /*the flags that pick the allocator*/
+#define PAYLOAD_ALIGN 16 /*the alignment of a payload copied onto a stack*/
+#define IDLE_FUTEX 1             /*the idle scheduler sleeps on the idle futex*/
+#define IDLE_POLL 2              /*the idle scheduler sleeps in poll, for timers and fds*/
+#define KEY_ROUNDS 4             /*the rounds of destructors run at a thread's exit*/
+#define WAITS_MIN 16             /*the initial size of the timers heap and the fd waits*/
 
 static int release_memory(void);    /*see below*/
-void thread_signals_handler(int); /*see below*/
+void thread_signals_handler(int, siginfo_t *, void *); /*see below*/
+static void thread_start(void);     /*see below*/
+static void keys_destroy(ut_slot);  /*see below*/
+static void schedule(int);          /*see below*/
 
 /*
  * the initialization is redundant since static variables are guaranteed
  * to be automatically initialized to 0, but this is to assure the user.
  */
 static ut_slot threads_table = NULL; /*the table that holds the threads' data*/
+static ut_hot_slot threads_hot = NULL; /*the scheduling fields of the table's slots*/
+static ut_arena_t arena; /*holds the threads table, the stacks and ut_alloc()'s memory*/
+static ut_arena_t stack_pool; /*holds the stacks under UT_STACK_HUGE*/
+_Static_assert(sizeof(ut_hot_slot_t) == 32, "two hot slots should share a cache line");
 static volatile int threads_table_size = 0; /*number of threads*/
-static tid_t next_position = 0; /*the next available index in the table*/
+static tid_t free_head = NO_THREAD; /*the first slot in the free slots list*/
+static tid_t run_head = NO_THREAD; /*the first thread in the run queue*/
+static tid_t run_tail = NO_THREAD; /*the last thread in the run queue*/
+static int live_threads = 0; /*number of spawned threads which have not exited yet*/
 static volatile int curr_thread = 0; /*current thread running, by index*/
+static int started = 0; /*set while ut_start is running the threads (atomic)*/
+static int idle = 0; /*IDLE_FUTEX or IDLE_POLL while the scheduler waits for a ready thread (atomic)*/
+static int idle_seq = 0; /*futex word the idle scheduler sleeps on (atomic)*/
+static int remote_head = NO_THREAD; /*the remote wakeups list (atomic)*/
+static int wake_fd = -1; /*an eventfd which wakes the scheduler out of an idle poll*/
+static ut_timer_t **timers = NULL; /*the armed timers, a min-heap by deadline*/
+static int timers_len = 0, timers_size = 0;
+static ut_io_wait_t **io_waits = NULL; /*the file descriptors waited for*/
+static struct pollfd *io_fds = NULL; /*the poll set of io_waits, with room for wake_fd*/
+static int io_len = 0, io_size = 0;
+static const struct timespec no_wait = {0, 0};
+static __thread int on_worker = 0; /*set on the kernel thread running ut_start*/
+static pthread_t worker; /*the kernel thread running ut_start*/
+
+/*
+ * the preemption state of the kernel thread running the scheduler, shared
+ * with the signal handler (every kernel thread has its own copy, only the
+ * scheduler's one is ever checked). preempt_count is the depth of
+ * ut_preempt_disable() calls of the running thread, and need_resched is set
+ * by a tick that could not preempt it, so the switch takes place once the
+ * count drops to 0.
+ */
+static __thread struct {
+    int preempt_count;
+    int need_resched;
+} this_worker;
 static unsigned long vtime = 0; /*used to keep track of threads running time*/
+static unsigned long quantum = QUANTUM * 1000000UL; /*the time slice, in microseconds*/
+static ut_sched_stats_t sched_stats; /*only updated by the scheduler's kernel thread*/
+static int stack_policy = UT_STACK_FIXED;
+static size_t stack_size = STACKSIZE; /*the default stack size*/
+static int stack_alloc_flags = 0;
+static unsigned long long stack_idle_ns = 0; /*how long a thread is parked before its stack is released*/
+
+/*
+ * the thread-local keys. protected by the scheduler lock.
+ */
+static struct {
+    int used;
+    void (*destructor)(void *);
+} keys[UT_KEYS_MAX];
+
+/*
+ * the peak stack usage recorded for every thread function, in an open
+ * addressing hash table keyed by the function's address (whatever the
+ * function's type, see thread_func()). protected by the scheduler lock.
+ */
+typedef void (*thread_func_t)(void);
+static struct {
+    thread_func_t func;
+    size_t peak;
+} stack_funcs[STACK_FUNCS];
 
+static sigset_t sched_signals; /*the signals blocked while running the signal handler*/
 static struct sigaction old_sigaction; /*holds the sigaction originally assigned to SIGINT signal*/
+static struct sigaction old_alarm_action, old_vtalarm_action; /*and those of the timer signals*/
 static ucontext_t uc_out; /*holds the original context (main) before running ut_start*/
 
 
@@ -40,46 +135,607 @@ static ucontext_t uc_out; /*holds the original context (main) before running ut_
  * in case the memory allocation fails.
  */
 int ut_init(int tab_size) {
+    int i;
     if (tab_size > MAX_TAB_SIZE || tab_size < MIN_TAB_SIZE)
         tab_size = MAX_TAB_SIZE;
     if (threads_table)
         release_memory();
     threads_table_size = tab_size;
-    next_position = 0;
     curr_thread = 0;
-    threads_table = (ut_slot)malloc((tab_size) * sizeof(ut_slot_t));
-    if (threads_table)
-        return 0;
+    run_head = run_tail = NO_THREAD;
+    live_threads = 0;
+    memset(&sched_stats, 0, sizeof(sched_stats));
+    ut_arena_init(&arena, 0);
+    ut_arena_init(&stack_pool, UT_ARENA_GUARD);
+    sigemptyset(&sched_signals);
+    sigaddset(&sched_signals, SIGALRM);
+    sigaddset(&sched_signals, SIGVTALRM);
+    sigaddset(&sched_signals, SIGINT);
+    threads_hot = (ut_hot_slot)ut_arena_alloc(&arena, tab_size * sizeof(ut_hot_slot_t), UT_CACHE_LINE);
+    threads_table = (ut_slot)ut_arena_alloc(&arena, tab_size * sizeof(ut_slot_t), UT_CACHE_LINE);
+    if (!threads_hot || !threads_table){
+        ut_arena_release(&arena);
+        threads_hot = NULL;
+        threads_table = NULL;
+        return SYS_ERR;
+    }
+    memset(threads_hot, 0, tab_size * sizeof(ut_hot_slot_t));
+    memset(threads_table, 0, tab_size * sizeof(ut_slot_t));
+    for (i = 0; i < tab_size; i++){
+        threads_hot[i].state = UT_FREE;
+        threads_hot[i].next = (i + 1 < tab_size) ? i + 1 : NO_THREAD;
+    }
+    free_head = 0;
+    return 0;
+}
+
+/*
+ * the clock of the scheduling statistics, in nanoseconds. reading it costs no
+ * system call (it is served by the vDSO), and is safe in the signal handler.
+ */
+static unsigned long long sched_clock(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * appends the given thread to the tail of the run queue and marks it as
+ * ready, ending the time it was blocked if it was. should be called with the
+ * scheduler lock held (or from within the signal handler, which runs with the
+ * scheduler signals blocked).
+ */
+static void enqueue(tid_t tid){
+    ut_hot_slot hot = &(threads_hot[tid]);
+    unsigned long long now = sched_clock();
+    if (hot->state == UT_BLOCKED){
+        threads_table[tid].stats.blocked_ns += now - hot->since;
+        UT_TRACE(UT_TRACE_WAKE, tid, curr_thread);
+    }
+    hot->since = now;
+    hot->state = UT_READY;
+    hot->next = NO_THREAD;
+    if (run_tail == NO_THREAD)
+        run_head = tid;
     else
+        threads_hot[run_tail].next = tid;
+    run_tail = tid;
+}
+
+/*
+ * removes the thread at the head of the run queue and returns its TID, or
+ * NO_THREAD if the queue is empty. same locking rules as enqueue().
+ */
+static tid_t dequeue(void){
+    tid_t tid = run_head;
+    if (tid != NO_THREAD){
+        run_head = threads_hot[tid].next;
+        if (run_head == NO_THREAD)
+            run_tail = NO_THREAD;
+    }
+    return tid;
+}
+
+/*
+ * makes next the running thread and accounts for the switch to it from last
+ * (NO_THREAD for the switch from ut_start, and next itself when the current
+ * thread keeps running, which is no switch at all). the time next waited in
+ * the run queue is also its wake-to-run latency. preempted tells whether
+ * last was preempted or gave up the processor by itself.
+ */
+static void set_running(tid_t last, tid_t next, int preempted){
+    ut_slot slot = &(threads_table[next]);
+    ut_hot_slot hot = &(threads_hot[next]);
+    unsigned long long now;
+    hot->state = UT_RUNNING;
+    hot->stack_released = 0;
+    curr_thread = next;
+    if (next == last)
+        return;
+    now = sched_clock();
+    ut_hist_record(&(slot->latency), now - hot->since);
+    UT_TRACE(preempted ? UT_TRACE_PREEMPT : UT_TRACE_SWITCH, next, last);
+    slot->stats.ready_ns += now - hot->since;
+    hot->since = now;
+    slot->stats.switch_ins++;
+    if (last == NO_THREAD)
+        return;
+    if (preempted)
+        threads_table[last].stats.involuntary++;
+    else
+        threads_table[last].stats.voluntary++;
+}
+
+/*
+ * the entry of a function in the stack usage table, or NULL if the function
+ * has no entry and the table is full. a new entry has a peak of 0.
+ */
+static size_t *stack_func_peak(thread_func_t func){
+    unsigned long i, h = ((unsigned long)func >> 4) % STACK_FUNCS;
+    for (i = 0; i < STACK_FUNCS; i++, h = (h + 1) % STACK_FUNCS){
+        if (stack_funcs[h].func == func)
+            return &(stack_funcs[h].peak);
+        if (!stack_funcs[h].func){
+            stack_funcs[h].func = func;
+            stack_funcs[h].peak = 0;
+            return &(stack_funcs[h].peak);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * the deepest point a watermarked stack reached: stacks grow down, so this
+ * is everything above the lowest word the pattern was overwritten in.
+ */
+static size_t stack_scan(ut_slot slot){
+    if (slot->stack_flags & UT_STACK_MMAP)
+        return ut_stack_resident(slot->stack, slot->stack_size);
+    const unsigned long *p = (const unsigned long *)slot->stack;
+    const unsigned long *end = p + slot->stack_size / sizeof(unsigned long);
+    unsigned long pattern;
+    memset(&pattern, STACK_PATTERN, sizeof(pattern));
+    while (p < end && *p == pattern)
+        p++;
+    return (const char *)end - (const char *)p;
+}
+
+/*
+ * behaves as described in the header.
+ */
+int ut_set_stack_policy(int policy, size_t size){
+    if (policy < UT_STACK_FIXED || policy > UT_STACK_AUTO || (size && size < MIN_STACKSIZE))
+        return SYS_ERR;
+    ut_sched_lock();
+    stack_policy = policy;
+    stack_size = size ? size : STACKSIZE;
+    ut_sched_unlock();
+    return 0;
+}
+
+int ut_set_stack_alloc(int flags, unsigned long idle_usec){
+    if (flags != 0 && flags != UT_STACK_HUGE && flags != UT_STACK_MMAP &&
+        flags != (UT_STACK_MMAP | UT_STACK_RELEASE))
         return SYS_ERR;
+    ut_sched_lock();
+    stack_alloc_flags = flags;
+    stack_idle_ns = idle_usec * 1000ULL;
+    ut_sched_unlock();
+    return 0;
 }
 
 /*
- * behaves as described in the header file: creates a stack for the context's
- * usage, creates a new context and initializes it to point to the original
- * context, and initializes the thread's table entry additional fields and
- * advences the table's next available slot index.
+ * gives back the unused pages of the stacks of the threads which have been
+ * parked long enough, at the ticks and before the scheduler sleeps idle. the
+ * current thread is skipped, since it may be parking right now, still running
+ * on its stack.
  */
-tid_t ut_spawn_thread(void (*func)(int), int arg){
-    if (next_position == threads_table_size)
+static void stack_sweep(void){
+    unsigned long long now = sched_clock();
+    ut_hot_slot hot;
+    ut_slot slot;
+    int i;
+    if (!(stack_alloc_flags & UT_STACK_RELEASE))
+        return;
+    for (i = 0; i < threads_table_size; i++){
+        hot = &(threads_hot[i]);
+        if (i == curr_thread || hot->state != UT_BLOCKED || hot->stack_released ||
+            now - hot->since < stack_idle_ns)
+            continue;
+        slot = &(threads_table[i]);
+        if (slot->stack_flags & UT_STACK_MMAP)
+            ut_stack_release(slot->stack, slot->park_sp - STACK_RELEASE_MARGIN);
+        hot->stack_released = 1;
+    }
+}
+
+/*
+ * the arena the stacks allocated with the given flags come from.
+ */
+static ut_arena_t *stack_arena(int flags){
+    return (flags & UT_STACK_HUGE) ? &stack_pool : &arena;
+}
+
+void *ut_alloc(size_t size){
+    void *p;
+    ut_sched_lock();
+    p = ut_arena_alloc(&arena, size, sizeof(long double));
+    ut_sched_unlock();
+    if (p)
+        memset(p, 0, size);
+    return p;
+}
+
+long ut_stack_usage(tid_t tid){
+    if (tid < 0 || tid >= threads_table_size || !threads_table[tid].watermarked)
+        return SYS_ERR;
+    return (long)stack_scan(&(threads_table[tid]));
+}
+
+long ut_stack_memory(tid_t tid, long *resident){
+    ut_slot slot;
+    if (tid < 0 || tid >= threads_table_size || !threads_table[tid].stack)
+        return SYS_ERR;
+    slot = &(threads_table[tid]);
+    if (resident)
+        *resident = (long)ut_stack_committed(slot->stack, slot->stack_size);
+    return (long)slot->stack_size;
+}
+
+size_t ut_stack_recommend(void (*func)(int)){
+    size_t *peak, size = 0;
+    ut_sched_lock();
+    peak = stack_func_peak((thread_func_t)func);
+    if (peak && *peak){
+        size = (*peak + *peak / 2 + STACK_SIGNAL_ROOM + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+        if (size < MIN_STACKSIZE)
+            size = MIN_STACKSIZE;
+    }
+    ut_sched_unlock();
+    return size;
+}
+
+/*
+ * the function a thread runs, as the key of the stack usage table.
+ */
+static thread_func_t thread_func(ut_slot slot){
+    return slot->fn ? (thread_func_t)slot->fn : (thread_func_t)slot->func;
+}
+
+/*
+ * spawns a thread running fn(arg), or fn on a copy of the payload if there is
+ * one (made by init if given, or bytewise), or nothing yet if fn is NULL
+ * (ut_spawn_thread sets the thread's function right after). takes the first
+ * free slot, reuses the stack left there by the slot's previous thread (if it
+ * has the size the attributes or the stack policy pick for the new thread) or
+ * allocates a new one, copies the payload to the top of the stack, creates a
+ * new context that starts in
+ * thread_start (which calls the thread's function) below the payload,
+ * initializes the thread's table entry additional fields and appends the new
+ * thread to the run queue. should be called with the scheduler lock held.
+ * a reused mapped stack that is watermarked gives its pages below the payload
+ * back first, since its usage is measured by the pages resident in it and
+ * the previous thread's pages would count for the new thread.
+ */
+static tid_t spawn(thread_func_t key, void (*fn)(void *), void *arg, const void *payload,
+                   size_t payload_size, void (*init)(void *, void *), const ut_attr_t *attr){
+    tid_t tid = free_head;
+    ut_slot slot;
+    size_t size;
+    char *top;
+    int reused;
+    if (tid == NO_THREAD)
         return TAB_FULL;
-    void *stack = (void *)malloc(STACKSIZE);
-    if (!stack || getcontext(&(threads_table[next_position].uc)) == -1)
+    if ((attr && attr->stack_size && attr->stack_size < MIN_STACKSIZE) ||
+        payload_size > UT_MAX_PAYLOAD)
+        return SYS_ERR;
+    slot = &(threads_table[tid]);
+    size = stack_size;
+    if (attr && attr->stack_size)
+        size = attr->stack_size;
+    else if (stack_policy == UT_STACK_AUTO && (size = ut_stack_recommend((void (*)(int))key)) == 0)
+        size = stack_size;
+    if (stack_alloc_flags & UT_STACK_MMAP)
+        size = (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    if (slot->stack && (slot->stack_size != size ||
+        (slot->stack_flags & STACK_KIND) != (stack_alloc_flags & STACK_KIND))){
+        ut_stack_free(stack_arena(slot->stack_flags), slot->stack, slot->stack_size,
+                      slot->stack_flags);
+        slot->stack = NULL;
+    }
+    reused = (slot->stack != NULL);
+    if (!slot->stack &&
+        !(slot->stack = ut_stack_alloc(stack_arena(stack_alloc_flags), size, stack_alloc_flags)))
+        return SYS_ERR;
+    slot->stack_size = size;
+    slot->stack_flags = stack_alloc_flags;
+    threads_hot[tid].stack_released = 0;
+    slot->watermarked = (stack_policy != UT_STACK_FIXED);
+    if (slot->watermarked && !(slot->stack_flags & UT_STACK_MMAP))
+        memset(slot->stack, STACK_PATTERN, size);
+    if (getcontext(&(slot->uc)) == -1)
+        return SYS_ERR;
+    top = (char *)slot->stack + size;
+    if (payload)
+        top = (char *)((unsigned long)(top - payload_size) & ~(unsigned long)(PAYLOAD_ALIGN - 1));
+    if (reused && slot->watermarked && (slot->stack_flags & UT_STACK_MMAP))
+        ut_stack_release(slot->stack, top);
+    if (payload){
+        if (init)
+            init(top, (void *)payload);
+        else
+            memcpy(top, payload, payload_size);
+        arg = top;
+    }
+    slot->uc.uc_link = &(uc_out);
+    slot->uc.uc_stack.ss_sp = slot->stack;
+    slot->uc.uc_stack.ss_size = top - (char *)slot->stack;
+    makecontext(&(slot->uc), thread_start, 0);
+    threads_hot[tid].vtime = 0;
+    memset(&(slot->stats), 0, sizeof(slot->stats));
+    ut_hist_init(&(slot->latency));
+    memset(slot->locals, 0, sizeof(slot->locals));
+    slot->keyed = 0;
+    slot->cancel_pending = 0;
+    slot->fn = fn;
+    slot->fn_arg = arg;
+    slot->func = NULL;
+    slot->joinable = attr ? attr->joinable : 0;
+    slot->joiner = NO_THREAD;
+    free_head = threads_hot[tid].next;
+    live_threads++;
+    enqueue(tid);
+    UT_TRACE(UT_TRACE_SPAWN, tid, ut_self());
+    return tid;
+}
+
+tid_t ut_spawn_thread(void (*func)(int), int arg){
+    tid_t tid;
+    ut_sched_lock();
+    tid = spawn((thread_func_t)func, NULL, NULL, NULL, 0, NULL, NULL);
+    if (tid >= 0){
+        threads_table[tid].func = func;
+        threads_table[tid].arg = arg;
+    }
+    ut_sched_unlock();
+    return tid;
+}
+
+void ut_attr_init(ut_attr_t *attr){
+    attr->stack_size = 0;
+    attr->joinable = 0;
+}
+
+tid_t ut_spawn(void (*fn)(void *), void *arg, const ut_attr_t *attr){
+    tid_t tid;
+    ut_sched_lock();
+    tid = spawn((thread_func_t)fn, fn, arg, NULL, 0, NULL, attr);
+    ut_sched_unlock();
+    return tid;
+}
+
+tid_t ut_spawn_copy(void (*fn)(void *), const void *payload, size_t size, const ut_attr_t *attr){
+    tid_t tid;
+    ut_sched_lock();
+    tid = spawn((thread_func_t)fn, fn, NULL, payload, size, NULL, attr);
+    ut_sched_unlock();
+    return tid;
+}
+
+tid_t ut_spawn_emplace(void (*fn)(void *), size_t size, void (*init)(void *place, void *ctx),
+                       void *ctx, const ut_attr_t *attr){
+    tid_t tid;
+    ut_sched_lock();
+    tid = spawn((thread_func_t)fn, fn, NULL, ctx, size, init, attr);
+    ut_sched_unlock();
+    return tid;
+}
+
+/*
+ * returns the slot of an exited thread to the free slots list. should be
+ * called with the scheduler lock held.
+ */
+static void free_slot(tid_t tid){
+    threads_hot[tid].state = UT_FREE;
+    threads_hot[tid].next = free_head;
+    free_head = tid;
+}
+
+/*
+ * behaves as described in the header. the joining thread parks until the
+ * exiting thread finds it in its slot (see thread_start).
+ */
+int ut_join(tid_t tid){
+    ut_slot slot;
+    if (tid < 0 || tid >= threads_table_size)
         return SYS_ERR;
-    threads_table[next_position].uc.uc_link = &(uc_out);
-    threads_table[next_position].uc.uc_stack.ss_sp = stack;
-    threads_table[next_position].uc.uc_stack.ss_size = STACKSIZE;
-    makecontext(&(threads_table[next_position].uc), (void(*)(void))func, 1, arg);
-    threads_table[next_position].vtime = 0;
-    threads_table[next_position].func = func;
-    threads_table[next_position].arg = arg;
-    return next_position++;
+    slot = &(threads_table[tid]);
+    ut_sched_lock();
+    if (threads_hot[tid].state == UT_FREE || !slot->joinable || slot->joiner != NO_THREAD ||
+        tid == ut_self()){
+        ut_sched_unlock();
+        return SYS_ERR;
+    }
+    slot->joiner = ut_self();
+    while (threads_hot[tid].state != UT_EXITED){
+        if (ut_park() == SYS_ERR){
+            slot->joiner = NO_THREAD;
+            ut_sched_unlock();
+            return SYS_ERR;
+        }
+    }
+    slot->joiner = NO_THREAD;
+    slot->joinable = 0;
+    free_slot(tid);
+    ut_sched_unlock();
+    return 0;
+}
+
+int ut_detach(tid_t tid){
+    ut_slot slot;
+    if (tid < 0 || tid >= threads_table_size)
+        return SYS_ERR;
+    slot = &(threads_table[tid]);
+    ut_sched_lock();
+    if (threads_hot[tid].state == UT_FREE || !slot->joinable || slot->joiner != NO_THREAD){
+        ut_sched_unlock();
+        return SYS_ERR;
+    }
+    slot->joinable = 0;
+    if (threads_hot[tid].state == UT_EXITED)
+        free_slot(tid);
+    ut_sched_unlock();
+    return 0;
+}
+
+/*
+ * the entry point of every thread: makes the thread preemptible (it is always
+ * switched to with preemption disabled, see switch_context()), runs the thread's
+ * function and, once it returns, returns the slot to the free slots list (or,
+ * for a joinable thread, leaves it to ut_join and wakes the joining thread up)
+ * and switches to the next thread for good. the slot keeps its stack for the next
+ * spawn, since the exiting thread is still running on it. the peak usage of a
+ * watermarked stack is recorded for the thread's function, and then the pages
+ * of a mapped stack below the current frame may be given back.
+ */
+static void thread_start(void){
+    ut_slot slot = &(threads_table[curr_thread]);
+    size_t *peak, usage;
+    char frame;
+    this_worker.preempt_count = 0;
+    ut_signal_fence(UT_SEQ_CST);
+    if (slot->fn)
+        slot->fn(slot->fn_arg);
+    else
+        slot->func(slot->arg);
+    if (slot->keyed)
+        keys_destroy(slot);
+    ut_sched_lock();
+    if (slot->watermarked && (peak = stack_func_peak(thread_func(slot))) &&
+        (usage = stack_scan(slot)) > *peak)
+        *peak = usage;
+    if ((slot->stack_flags & UT_STACK_RELEASE) == UT_STACK_RELEASE)
+        ut_stack_release(slot->stack, &frame - STACK_RELEASE_MARGIN);
+    UT_TRACE(UT_TRACE_EXIT, curr_thread, 0);
+    if (slot->joinable){
+        threads_hot[curr_thread].state = UT_EXITED;
+        if (slot->joiner != NO_THREAD)
+            ut_unpark(slot->joiner);
+    }
+    else
+        free_slot(curr_thread);
+    live_threads--;
+    schedule(0);
+}
+
+/*
+ * returns where a thread keeps its value of a key, or NULL if its table of
+ * values does not reach the key.
+ */
+static void **key_value(ut_slot slot, ut_key_t key){
+    if (key < UT_KEYS_INLINE)
+        return &(slot->locals[key]);
+    key -= UT_KEYS_INLINE;
+    return (key < slot->spill_size) ? &(slot->spill[key]) : NULL;
+}
+
+/*
+ * runs the destructors of an exiting thread's values, in the thread itself
+ * (so they may take locks or wait), and frees its table of values.
+ */
+static void keys_destroy(ut_slot slot){
+    void **value, *old, (*destructor)(void *);
+    int round, key, again = 1;
+    for (round = 0; round < KEY_ROUNDS && again; round++){
+        again = 0;
+        for (key = 0; key < UT_KEYS_MAX; key++){
+            if (!(value = key_value(slot, key)) || !*value)
+                continue;
+            ut_sched_lock();
+            old = *value;
+            *value = NULL;
+            destructor = keys[key].destructor;
+            ut_sched_unlock();
+            if (old && destructor){
+                destructor(old);
+                again = 1;
+            }
+        }
+    }
+    ut_sched_lock();
+    free(slot->spill);
+    slot->spill = NULL;
+    slot->spill_size = 0;
+    ut_sched_unlock();
+}
+
+int ut_key_create(ut_key_t *key, void (*destructor)(void *)){
+    int k;
+    ut_sched_lock();
+    for (k = 0; k < UT_KEYS_MAX && keys[k].used; k++)
+        ;
+    if (k < UT_KEYS_MAX){
+        keys[k].used = 1;
+        keys[k].destructor = destructor;
+        *key = k;
+    }
+    ut_sched_unlock();
+    return (k < UT_KEYS_MAX) ? 0 : SYS_ERR;
+}
+
+/*
+ * the values are dropped from every slot, so a thread never finds the value
+ * of a deleted key under a key created later.
+ */
+int ut_key_delete(ut_key_t key){
+    void **value;
+    int i;
+    if (key < 0 || key >= UT_KEYS_MAX)
+        return SYS_ERR;
+    ut_sched_lock();
+    if (!keys[key].used){
+        ut_sched_unlock();
+        return SYS_ERR;
+    }
+    keys[key].used = 0;
+    keys[key].destructor = NULL;
+    for (i = 0; threads_table && i < threads_table_size; i++)
+        if ((value = key_value(&(threads_table[i]), key)))
+            *value = NULL;
+    ut_sched_unlock();
+    return 0;
+}
+
+void *ut_getspecific(ut_key_t key){
+    void **value;
+    if (key < 0 || key >= UT_KEYS_MAX || !ut_in_scheduler())
+        return NULL;
+    value = key_value(&(threads_table[curr_thread]), key);
+    return value ? *value : NULL;
+}
+
+/*
+ * an inline value is set without the lock, since only ut_key_delete() writes
+ * another thread's values. the table of values grows by doubling.
+ */
+int ut_setspecific(ut_key_t key, const void *value){
+    ut_slot slot;
+    void **spill;
+    int size, ret = 0;
+    if (key < 0 || key >= UT_KEYS_MAX || !keys[key].used || !ut_in_scheduler())
+        return SYS_ERR;
+    slot = &(threads_table[curr_thread]);
+    slot->keyed = 1;
+    if (key < UT_KEYS_INLINE){
+        slot->locals[key] = (void *)value;
+        return 0;
+    }
+    ut_sched_lock();
+    if (key - UT_KEYS_INLINE >= slot->spill_size){
+        size = slot->spill_size ? 2 * slot->spill_size : UT_KEYS_INLINE;
+        if (size <= key - UT_KEYS_INLINE)
+            size = key - UT_KEYS_INLINE + 1;
+        if (size > UT_KEYS_MAX - UT_KEYS_INLINE)
+            size = UT_KEYS_MAX - UT_KEYS_INLINE;
+        if ((spill = (void **)realloc(slot->spill, size * sizeof(void *)))){
+            memset(spill + slot->spill_size, 0, (size - slot->spill_size) * sizeof(void *));
+            slot->spill = spill;
+            slot->spill_size = size;
+        }
+        else
+            ret = SYS_ERR;
+    }
+    if (ret == 0)
+        slot->spill[key - UT_KEYS_INLINE] = (void *)value;
+    ut_sched_unlock();
+    return ret;
 }
 
 /*
  * frees the dynamically allocated data structures of this library,
  * which includes the stacks used by the ucontexts and the threads
- * table itself. should print an error in case the table was not
+ * table itself: the mapped stacks one by one, and the rest (with the
+ * memory of ut_alloc) by releasing the arena. should print an error in case the table was not
  * initialized or points to NULL.
  *
  * Returns:
@@ -88,45 +744,767 @@ tid_t ut_spawn_thread(void (*func)(int), int arg){
 static int release_memory(void){
     int i;
     if (threads_table){
-        for (i = 0; i < threads_table_size; i++)
-            free(threads_table[i].uc.uc_stack.ss_sp);
-        free((void *)threads_table);
+        for (i = 0; i < threads_table_size; i++){
+            if (threads_table[i].stack_flags & UT_STACK_MMAP)
+                ut_stack_free(NULL, threads_table[i].stack, threads_table[i].stack_size,
+                              threads_table[i].stack_flags);
+            free(threads_table[i].spill);
+        }
+        ut_arena_release(&stack_pool);
+        ut_arena_release(&arena);
+        free(timers);
+        free(io_waits);
+        free(io_fds);
+        timers = NULL;
+        io_waits = NULL;
+        io_fds = NULL;
+        timers_len = timers_size = io_len = io_size = 0;
+        threads_table = NULL;
+        threads_hot = NULL;
         return 0;
     }
     perror("Could not relase memory.\n");
     exit(EXIT_FAILURE);
 }
 
+/*
+ * takes the whole remote wakeups list at once (so the list is never popped
+ * while other kernel threads push to it) and unparks the threads in it.
+ * same locking rules as enqueue().
+ */
+static void drain_remote(void){
+    int tid = ut_atomic_xchg(&remote_head, NO_THREAD, UT_ACQUIRE), next;
+    while (tid != NO_THREAD){
+        next = threads_hot[tid].remote_next;
+        ut_atomic_store(&(threads_hot[tid].remote_queued), 0, UT_RELAXED);
+        ut_unpark(tid);
+        tid = next;
+    }
+}
+
+unsigned long long ut_clock(void){
+    return sched_clock();
+}
+
+/*
+ * the timers heap keeps every timer's index up to date, so a timer is
+ * stopped (by its waiter, or when it fires) in logarithmic time.
+ */
+static void timers_up(int i){
+    ut_timer_t *timer = timers[i];
+    while (i > 0 && timers[(i - 1) / 2]->deadline > timer->deadline){
+        timers[i] = timers[(i - 1) / 2];
+        timers[i]->index = i;
+        i = (i - 1) / 2;
+    }
+    timers[i] = timer;
+    timer->index = i;
+}
+
+static void timers_down(int i){
+    ut_timer_t *timer = timers[i];
+    int child;
+    while ((child = 2 * i + 1) < timers_len){
+        if (child + 1 < timers_len && timers[child + 1]->deadline < timers[child]->deadline)
+            child++;
+        if (timers[child]->deadline >= timer->deadline)
+            break;
+        timers[i] = timers[child];
+        timers[i]->index = i;
+        i = child;
+    }
+    timers[i] = timer;
+    timer->index = i;
+}
+
+int ut_timer_start(ut_timer_t *timer){
+    ut_timer_t **grown;
+    int size;
+    if (timers_len == timers_size){
+        size = timers_size ? 2 * timers_size : WAITS_MIN;
+        if (!(grown = (ut_timer_t **)realloc(timers, size * sizeof(*timers))))
+            return SYS_ERR;
+        timers = grown;
+        timers_size = size;
+    }
+    timers[timers_len] = timer;
+    timers_up(timers_len++);
+    return 0;
+}
+
+void ut_timer_stop(ut_timer_t *timer){
+    int i = timer->index;
+    if (i < 0)
+        return;
+    timer->index = -1;
+    if (i == --timers_len)
+        return;
+    timers[i] = timers[timers_len];
+    if (i > 0 && timers[(i - 1) / 2]->deadline > timers[i]->deadline)
+        timers_up(i);
+    else
+        timers_down(i);
+}
+
+/*
+ * fires the timers whose deadline passed. same locking rules as enqueue().
+ */
+static void timers_expire(unsigned long long now){
+    ut_timer_t *timer;
+    while (timers_len > 0 && timers[0]->deadline <= now){
+        timer = timers[0];
+        ut_timer_stop(timer);
+        if (timer->fire)
+            timer->fire(timer);
+        else
+            ut_unpark(timer->tid);
+    }
+}
+
+int ut_io_start(ut_io_wait_t *wait){
+    ut_io_wait_t **waits;
+    struct pollfd *fds;
+    int size;
+    if (io_len == io_size){
+        size = io_size ? 2 * io_size : WAITS_MIN;
+        if (!(waits = (ut_io_wait_t **)realloc(io_waits, size * sizeof(*io_waits))))
+            return SYS_ERR;
+        io_waits = waits;
+        if (!(fds = (struct pollfd *)realloc(io_fds, (size + 1) * sizeof(*io_fds))))
+            return SYS_ERR;
+        io_fds = fds;
+        io_size = size;
+    }
+    wait->index = io_len;
+    io_waits[io_len++] = wait;
+    return 0;
+}
+
+void ut_io_stop(ut_io_wait_t *wait){
+    int i = wait->index;
+    if (i < 0)
+        return;
+    wait->index = -1;
+    if (i == --io_len)
+        return;
+    io_waits[i] = io_waits[io_len];
+    io_waits[i]->index = i;
+}
+
+/*
+ * polls every waited file descriptor at once (and wake, unless it is -1,
+ * which only interrupts the poll) and fires the waits which are ready. the
+ * waits are scanned from the last, so the one moved into the place of a
+ * stopped wait was already scanned. same locking rules as enqueue().
+ */
+static void io_poll(const struct timespec *timeout, int wake){
+    struct pollfd single, *fds = io_len ? io_fds : &single;
+    ut_io_wait_t *wait;
+    unsigned long long count;
+    int n = io_len, i;
+    for (i = 0; i < n; i++){
+        fds[i].fd = io_waits[i]->fd;
+        fds[i].events = io_waits[i]->events;
+        fds[i].revents = 0;
+    }
+    fds[n].fd = wake;
+    fds[n].events = POLLIN;
+    fds[n].revents = 0;
+    if (ppoll(fds, n + (wake != -1), timeout, NULL) <= 0)
+        return;
+    for (i = n - 1; i >= 0; i--){
+        if (!fds[i].revents)
+            continue;
+        wait = io_waits[i];
+        wait->revents = fds[i].revents;
+        ut_io_stop(wait);
+        if (wait->fire)
+            wait->fire(wait);
+        else
+            ut_unpark(wait->tid);
+    }
+    if (fds[n].revents && read(wake, &count, sizeof(count)) == -1)
+        return;
+}
+
+/*
+ * the idle sleep while timers are armed or file descriptors are waited for:
+ * a poll of the descriptors and the wakeup eventfd (which ut_unpark_remote()
+ * writes instead of waking the futex), until the nearest deadline. without
+ * an eventfd, the poll is cut short to a millisecond so remote wakeups are
+ * still noticed.
+ */
+static void idle_poll(int seq){
+    struct timespec ts, *timeout = NULL;
+    unsigned long long now, wait = ~0ULL;
+    if (wake_fd == -1)
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (timers_len > 0){
+        now = sched_clock();
+        wait = (timers[0]->deadline > now) ? timers[0]->deadline - now : 0;
+    }
+    if (wake_fd == -1 && wait > 1000000ULL)
+        wait = 1000000ULL;
+    if (wait != ~0ULL){
+        ts.tv_sec = wait / 1000000000ULL;
+        ts.tv_nsec = wait % 1000000000ULL;
+        timeout = &ts;
+    }
+    ut_atomic_store(&idle, IDLE_POLL, UT_SEQ_CST);
+    if (ut_atomic_load(&idle_seq, UT_SEQ_CST) == seq)
+        io_poll(timeout, wake_fd);
+    ut_atomic_store(&idle, 0, UT_RELAXED);
+    timers_expire(sched_clock());
+}
+
+/*
+ * saves the current context in from and resumes the one in to. the depth of
+ * preemption disabling belongs to the thread, so it is kept on the switching
+ * thread's stack and restored once the thread is switched back to. any due
+ * preemption is done with by the switch.
+ */
+static void switch_context(ucontext_t *from, ucontext_t *to){
+    int preempt_count = this_worker.preempt_count;
+    this_worker.need_resched = 0;
+    sched_stats.switches++;
+    if (swapcontext(from, to) == -1){
+        perror("\"swapcontext\" has failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    this_worker.preempt_count = preempt_count;
+}
+
+/*
+ * switches from the current thread to the thread at the head of the run
+ * queue. should be called with the scheduler lock held, after the caller has
+ * set the state of the current thread (and put it back in the run queue if it
+ * should keep running later). the due timers and the ready file descriptors
+ * wake their threads first. if no thread is ready, sleeps on the idle futex
+ * until a remote wakeup arrives (or in idle_poll() if some thread waits for a
+ * timer or a file descriptor; the ticks do nothing while idle), and if no
+ * thread is alive at all, returns to ut_start. the switched-to thread
+ * continues with preemption disabled, just like the caller when it is
+ * switched back to. preempted tells whether the current thread is switched
+ * out by a preemption, for the statistics.
+ */
+static void schedule(int preempted){
+    int last_thread = curr_thread, seq;
+    unsigned long long idle_since;
+    tid_t next;
+    drain_remote();
+    if (timers_len > 0)
+        timers_expire(sched_clock());
+    if (io_len > 0)
+        io_poll(&no_wait, -1);
+    while ((next = dequeue()) == NO_THREAD){
+        if (live_threads == 0)
+            setcontext(&uc_out);
+        stack_sweep();
+        seq = ut_atomic_load(&idle_seq, UT_ACQUIRE);
+        drain_remote();
+        if (run_head != NO_THREAD)
+            continue;
+        idle_since = sched_clock();
+        if (timers_len > 0 || io_len > 0)
+            idle_poll(seq);
+        else {
+            ut_atomic_store(&idle, IDLE_FUTEX, UT_SEQ_CST);
+            ut_futex_wait(&idle_seq, seq);
+            ut_atomic_store(&idle, 0, UT_RELAXED);
+        }
+        sched_stats.idle_ns += sched_clock() - idle_since;
+    }
+    set_running(last_thread, next, preempted);
+    if (next != last_thread)
+        switch_context(&(threads_table[last_thread].uc), &(threads_table[next].uc));
+}
+
+/*
+ * the deferred preemption of ut_preempt_enable(), the same as a yield.
+ */
+static void preempt_switch(void){
+    this_worker.preempt_count++;
+    ut_signal_fence(UT_SEQ_CST);
+    drain_remote();
+    if (run_head != NO_THREAD){
+        enqueue(curr_thread);
+        schedule(1);
+    }
+    ut_signal_fence(UT_SEQ_CST);
+    this_worker.preempt_count--;
+}
+
+/*
+ * the signal fences keep the compiler from moving the accesses of the
+ * critical section outside of it (the signal handler runs on the same
+ * kernel thread, so no processor barrier is needed). a tick may arrive
+ * between the decrement and the check, in which case it preempts the thread
+ * itself and clears need_resched.
+ */
+void ut_preempt_disable(void){
+    this_worker.preempt_count++;
+    ut_signal_fence(UT_SEQ_CST);
+}
+
+void ut_preempt_enable(void){
+    ut_signal_fence(UT_SEQ_CST);
+    if (--this_worker.preempt_count == 0 && this_worker.need_resched && ut_in_scheduler())
+        preempt_switch();
+}
+
+/*
+ * the scheduler lock is a preemption-disabled section, since the scheduler
+ * structures are only shared with other user-level threads (and the signal
+ * handler) of the same kernel thread.
+ */
+void ut_sched_lock(void){
+    ut_preempt_disable();
+}
+
+void ut_sched_unlock(void){
+    ut_preempt_enable();
+}
+
+/*
+ * behaves as described in the header, the caller is expected to have
+ * registered itself where the unparking thread will find it.
+ */
+int ut_park(void){
+    char frame;
+    if (!ut_atomic_load(&started, UT_RELAXED))
+        return SYS_ERR;
+    threads_hot[curr_thread].state = UT_BLOCKED;
+    threads_hot[curr_thread].since = sched_clock();
+    threads_table[curr_thread].park_sp = &frame;
+    UT_TRACE(UT_TRACE_BLOCK, curr_thread, 0);
+    schedule(0);
+    return 0;
+}
+
+/*
+ * the timer stays on the stack of the parked thread, and is stopped whatever
+ * woke the thread up.
+ */
+int ut_park_until(unsigned long long deadline){
+    ut_slot slot;
+    ut_timer_t timer;
+    int ret;
+    if (!ut_atomic_load(&started, UT_RELAXED))
+        return SYS_ERR;
+    slot = &(threads_table[curr_thread]);
+    if (slot->cancel_pending){
+        slot->cancel_pending = 0;
+        return UT_CANCELED;
+    }
+    timer.index = -1;
+    if (deadline){
+        if (deadline <= sched_clock())
+            return UT_TIMEDOUT;
+        timer.deadline = deadline;
+        timer.fire = NULL;
+        timer.tid = curr_thread;
+        if (ut_timer_start(&timer) == SYS_ERR)
+            return SYS_ERR;
+    }
+    ret = ut_park();
+    if (ret == 0 && slot->cancel_pending){
+        slot->cancel_pending = 0;
+        ret = UT_CANCELED;
+    }
+    else if (ret == 0 && deadline && timer.index == -1)
+        ret = UT_TIMEDOUT;
+    ut_timer_stop(&timer);
+    return ret;
+}
+
+void ut_unpark(tid_t tid){
+    if (0 <= tid && tid < threads_table_size && threads_hot[tid].state == UT_BLOCKED)
+        enqueue(tid);
+}
+
+int ut_thread_state(tid_t tid){
+    if (0 <= tid && tid < threads_table_size)
+        return threads_hot[tid].state;
+    return UT_FREE;
+}
+
+/*
+ * behaves as described in the header. the pushing is lock free: a slot is
+ * pushed at most once until the scheduler drains the list (remote_queued),
+ * and the scheduler takes the whole list at once, so the head can be swapped
+ * with a plain compare-and-swap. the idle sequence is advanced after the
+ * push, so an idle scheduler either sees the push before it goes to sleep or
+ * is woken up by the futex (or the eventfd, if it sleeps in a poll).
+ */
+void ut_unpark_remote(tid_t tid){
+    int head;
+    unsigned long long one = 1;
+    ut_hot_slot slot;
+    if (tid < 0 || tid >= threads_table_size)
+        return;
+    slot = &(threads_hot[tid]);
+    if (ut_atomic_xchg(&(slot->remote_queued), 1, UT_ACQ_REL))
+        return;
+    head = ut_atomic_load(&remote_head, UT_RELAXED);
+    do
+        slot->remote_next = head;
+    while (!ut_atomic_cas(&remote_head, &head, tid, UT_RELEASE));
+    ut_atomic_fetch_add(&idle_seq, 1, UT_SEQ_CST);
+    switch (ut_atomic_load(&idle, UT_SEQ_CST)){
+    case IDLE_FUTEX:
+        ut_futex_wake(&idle_seq, 1);
+        break;
+    case IDLE_POLL:
+        if (write(wake_fd, &one, sizeof(one)) == -1)
+            break;
+    }
+}
+
+int ut_in_scheduler(void){
+    return on_worker && ut_atomic_load(&started, UT_RELAXED);
+}
+
+void ut_futex_wait(int *addr, int val){
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+void ut_futex_wake(int *addr, int n){
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/*
+ * arms the one-shot real-time timer to raise the next SIGALRM after the given
+ * number of microseconds, or disarms it for 0. this is alarm() with a finer
+ * resolution, so the quantum need not be a whole number of seconds.
+ */
+static void set_tick(unsigned long usec){
+    struct itimerval itv;
+    itv.it_interval.tv_sec = itv.it_interval.tv_usec = 0;
+    itv.it_value.tv_sec = usec / 1000000;
+    itv.it_value.tv_usec = usec % 1000000;
+    setitimer(ITIMER_REAL, &itv, NULL);
+}
+
+/*
+ * behaves as described in the header, the new quantum takes effect at the
+ * next tick.
+ */
+int ut_set_quantum(unsigned long usec){
+    if (usec == 0)
+        return SYS_ERR;
+    quantum = usec;
+    return 0;
+}
+
+/*
+ * behaves as described in the header. when no other thread is ready the
+ * caller keeps running without going through the scheduler.
+ */
+void ut_yield(void){
+    ut_sched_lock();
+    drain_remote();
+    if (ut_atomic_load(&started, UT_RELAXED) && run_head != NO_THREAD){
+        enqueue(curr_thread);
+        schedule(0);
+    }
+    ut_sched_unlock();
+}
+
+/*
+ * behaves as described in the header. the thread may be unparked by
+ * something else than its timer (a remote wakeup that came late, for
+ * example), so it parks again until the deadline passed.
+ */
+int ut_sleep(unsigned long usec){
+    unsigned long long deadline;
+    int ret;
+    if (!ut_in_scheduler())
+        return SYS_ERR;
+    ut_sched_lock();
+    deadline = sched_clock() + usec * 1000ULL;
+    while ((ret = ut_park_until(deadline)) == 0)
+        ;
+    ut_sched_unlock();
+    return (ret == UT_TIMEDOUT) ? 0 : ret;
+}
+
+/*
+ * behaves as described in the header. an exited joinable thread cannot be
+ * canceled either, since it waits for nothing.
+ */
+int ut_cancel(tid_t tid){
+    int state;
+    if (tid < 0 || tid >= threads_table_size)
+        return SYS_ERR;
+    ut_sched_lock();
+    state = threads_hot[tid].state;
+    if (state == UT_FREE || state == UT_EXITED){
+        ut_sched_unlock();
+        return SYS_ERR;
+    }
+    threads_table[tid].cancel_pending = 1;
+    ut_unpark(tid);
+    ut_sched_unlock();
+    return 0;
+}
+
+void ut_cancel_restore(void){
+    if (ut_atomic_load(&started, UT_RELAXED))
+        threads_table[curr_thread].cancel_pending = 1;
+}
+
+int ut_testcancel(void){
+    ut_slot slot;
+    if (!ut_in_scheduler())
+        return 0;
+    slot = &(threads_table[curr_thread]);
+    if (!slot->cancel_pending)
+        return 0;
+    slot->cancel_pending = 0;
+    return 1;
+}
+
+int ut_wait_fd(int fd, int events){
+    ut_io_wait_t wait;
+    int ret = 0;
+    if (!ut_in_scheduler())
+        return SYS_ERR;
+    ut_sched_lock();
+    wait.fd = fd;
+    wait.events = events;
+    wait.revents = 0;
+    wait.fire = NULL;
+    wait.tid = curr_thread;
+    wait.index = -1;
+    ret = ut_io_start(&wait);
+    while (ret == 0 && wait.index != -1)
+        ret = ut_park();
+    ut_io_stop(&wait);
+    ut_sched_unlock();
+    return (ret == 0) ? wait.revents : ret;
+}
+
+tid_t ut_self(void){
+    return ut_atomic_load(&started, UT_RELAXED) ? curr_thread : NO_THREAD;
+}
+
+#ifdef PREEMPT_TRAMPOLINE
+#define RED_ZONE 128 /*the bytes below the stack pointer a function may use freely*/
+
+void ut_preempt_trampoline(void); /*see below*/
+
+#define XSTATE_AMX ((1UL << 17) | (1UL << 18)) /*the AMX tile state components*/
+
+/*
+ * the size of the area the trampoline saves the FPU/vector state in, whether
+ * the processor supports xsave (which saves the AVX state as well) or only
+ * fxsave, and the state components xsave saves. read by the trampoline's
+ * code, so marked as used.
+ */
+static unsigned long __attribute__((used)) fpu_save_size = 512;
+static int __attribute__((used)) fpu_use_xsave = 0;
+static unsigned long __attribute__((used)) fpu_xsave_mask = 0;
+
+/*
+ * the C part of the trampoline below, running on the preempted thread's
+ * stack but no longer inside the signal handler. the handler has disabled
+ * preemption, so the thread is switched out just like a yielding thread, and
+ * once it is switched back to, preemption is enabled again (which takes
+ * care of a preemption that became due meanwhile).
+ */
+static void __attribute__((used)) preempt_from_trampoline(void){
+    drain_remote();
+    if (run_head != NO_THREAD){
+        enqueue(curr_thread);
+        schedule(1);
+    }
+    ut_preempt_enable();
+}
+
+/*
+ * the trampoline a preempted thread is redirected to by the signal handler.
+ * the handler has pushed the interrupted instruction address below the red
+ * zone, so the trampoline is entered as if it was called from there. since
+ * the thread was interrupted at an arbitrary instruction, every register the
+ * C calling convention lets the callee change is saved: the flags, the
+ * caller-saved general purpose registers and the whole FPU/vector state
+ * (the callee-saved ones are kept by the C code, and by swapcontext when the
+ * thread is switched out). the final "ret $RED_ZONE" both returns to the
+ * interrupted instruction and releases the red zone.
+ */
+__asm__(
+    ".text\n"
+    ".p2align 4\n"
+    ".globl ut_preempt_trampoline\n"
+    ".type ut_preempt_trampoline, @function\n"
+    "ut_preempt_trampoline:\n"
+    "    pushfq\n"
+    "    cld\n"
+    "    pushq %rax\n"
+    "    pushq %rcx\n"
+    "    pushq %rdx\n"
+    "    pushq %rsi\n"
+    "    pushq %rdi\n"
+    "    pushq %r8\n"
+    "    pushq %r9\n"
+    "    pushq %r10\n"
+    "    pushq %r11\n"
+    "    pushq %rbp\n"
+    "    movq %rsp, %rbp\n"
+    "    andq $-64, %rsp\n"
+    "    subq fpu_save_size(%rip), %rsp\n"
+    "    cmpl $0, fpu_use_xsave(%rip)\n"
+    "    je 1f\n"
+    "    xorl %eax, %eax\n"
+    "    movq %rax, 512(%rsp)\n"
+    "    movq %rax, 520(%rsp)\n"
+    "    movq %rax, 528(%rsp)\n"
+    "    movq %rax, 536(%rsp)\n"
+    "    movq %rax, 544(%rsp)\n"
+    "    movq %rax, 552(%rsp)\n"
+    "    movq %rax, 560(%rsp)\n"
+    "    movq %rax, 568(%rsp)\n"
+    "    movl fpu_xsave_mask(%rip), %eax\n"
+    "    movl fpu_xsave_mask+4(%rip), %edx\n"
+    "    xsave64 (%rsp)\n"
+    "    jmp 2f\n"
+    "1:  fxsave64 (%rsp)\n"
+    "2:  call preempt_from_trampoline\n"
+    "    cmpl $0, fpu_use_xsave(%rip)\n"
+    "    je 3f\n"
+    "    movl fpu_xsave_mask(%rip), %eax\n"
+    "    movl fpu_xsave_mask+4(%rip), %edx\n"
+    "    xrstor64 (%rsp)\n"
+    "    jmp 4f\n"
+    "3:  fxrstor64 (%rsp)\n"
+    "4:  movq %rbp, %rsp\n"
+    "    popq %rbp\n"
+    "    popq %r11\n"
+    "    popq %r10\n"
+    "    popq %r9\n"
+    "    popq %r8\n"
+    "    popq %rdi\n"
+    "    popq %rsi\n"
+    "    popq %rdx\n"
+    "    popq %rcx\n"
+    "    popq %rax\n"
+    "    popfq\n"
+    "    ret $128\n"
+    ".size ut_preempt_trampoline, .-ut_preempt_trampoline\n");
+
+/*
+ * sets the trampoline to save the state components the kernel enabled, other
+ * than the AMX tiles (which take over 8KB, more than a thread stack can
+ * spare, and are only usable by threads which asked the kernel for them).
+ * the save area size is the end of the last saved component in the standard
+ * xsave layout, rounded to the 64 bytes xsave aligns to.
+ */
+static void fpu_save_init(void){
+    unsigned int a, b, c, d, i, lo, hi;
+    unsigned long size = 576; /*the legacy area and the xsave header*/
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_OSXSAVE))
+        return;
+    __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    fpu_xsave_mask = (((unsigned long)hi << 32) | lo) & ~XSTATE_AMX;
+    for (i = 2; i < 64; i++)
+        if ((fpu_xsave_mask & (1UL << i)) && __get_cpuid_count(0xd, i, &a, &b, &c, &d) &&
+            b + a > size)
+            size = b + a;
+    fpu_use_xsave = 1;
+    fpu_save_size = (size + 63) & ~63UL;
+}
+
+/*
+ * makes the interrupted thread "call" the trampoline once the handler
+ * returns: pushes the interrupted instruction address below the red zone of
+ * its stack and points the instruction pointer at the trampoline.
+ */
+static void redirect_to_trampoline(ucontext_t *uc){
+    greg_t *regs = uc->uc_mcontext.gregs;
+    unsigned long sp = regs[REG_RSP] - RED_ZONE - sizeof(unsigned long);
+    *(unsigned long *)sp = regs[REG_RIP];
+    regs[REG_RSP] = sp;
+    regs[REG_RIP] = (greg_t)ut_preempt_trampoline;
+}
+#endif
+
 /*
  * a handler for three different signals:
- * SIGALRM: when received, it creates a new alarm for the period defined by
- * QUANTUM, for the next context swap, then swaps between the current context
- * and the one that follows it in the threads table in a round robin manner.
+ * SIGALRM: when received, it arms the timer again for the period defined by
+ * the quantum, for the next context swap. if the current thread disabled
+ * preemption, it only marks the switch as due (see ut_preempt_enable), and
+ * otherwise it moves the current thread to the
+ * tail of the run queue and swaps its context with the one of the thread at
+ * the head of the queue (round robin among the ready threads). nothing is
+ * swapped if no other thread is ready, or if the scheduler is idle (since
+ * then the current thread is parked and is not really running).
+ * where the trampoline is supported, the swap does not take place inside the
+ * handler: the handler disables preemption and redirects the interrupted
+ * thread to the trampoline, which swaps once the handler has returned. so no
+ * thread is ever suspended inside a signal frame, and the switch itself runs
+ * under the normal signal mask, like any other code of the thread.
  * SIGVTALRM: advances the time for the current thread and updates vtime.
  * SIGINT: extracts the original handler assigned to this signal, calls it,
  * then releases the dynamically allocated memory by calling "release_memory".
  * assuming pressing CTRL+C terminates the program.
+ * the three signals are sent to the whole process, so they may be delivered
+ * to a foreign kernel thread of the process. SIGALRM and SIGINT are then
+ * forwarded to the scheduler's kernel thread, and SIGVTALRM is dropped since
+ * the CPU time it stands for was not consumed by a user-level thread. a tick
+ * that comes after the scheduler stopped is dropped as well, since the
+ * scheduler's kernel thread may have restored the original SIGALRM action
+ * already, and nothing is ever forwarded to the calling thread itself.
  *
  * Parameters:
  * signal - the signal number to be handled.
+ * info - unused.
+ * context - the interrupted context, as saved by the kernel.
  */
-void thread_signals_handler(int signal){
+void thread_signals_handler(int signal, siginfo_t *info, void *context){
     int last_thread;
+    if (!on_worker){
+        if ((signal == SIGINT || (signal == SIGALRM && ut_atomic_load(&started, UT_RELAXED))) &&
+            !pthread_equal(pthread_self(), worker))
+            pthread_kill(worker, signal);
+        return;
+    }
     if (signal == SIGALRM){
-        alarm(QUANTUM);
-        last_thread = curr_thread;
-        curr_thread =  ((curr_thread + 1) % threads_table_size);
-        if (swapcontext(&(threads_table[last_thread].uc), &(threads_table[curr_thread].uc)) == -1){
-            perror("\"swapcontext\" has failed.\n");
-            exit(EXIT_FAILURE);
+        if (!ut_atomic_load(&started, UT_RELAXED))
+            return;
+        set_tick(quantum);
+        sched_stats.ticks++;
+        if (ut_atomic_load(&idle, UT_RELAXED))
+            return;
+        if (this_worker.preempt_count > 0){
+            this_worker.need_resched = 1;
+            return;
         }
+        drain_remote();
+        stack_sweep();
+        if (timers_len > 0)
+            timers_expire(sched_clock());
+        if (io_len > 0)
+            io_poll(&no_wait, -1);
+        if (run_head == NO_THREAD)
+            return;
+#ifdef PREEMPT_TRAMPOLINE
+        this_worker.preempt_count = 1;
+        redirect_to_trampoline((ucontext_t *)context);
+        return;
+#endif
+        last_thread = curr_thread;
+        enqueue(last_thread);
+        set_running(last_thread, dequeue(), 1);
+        this_worker.preempt_count = 1;
+        switch_context(&(threads_table[last_thread].uc), &(threads_table[curr_thread].uc));
+        this_worker.preempt_count = 0;
     }
     else if (signal == SIGVTALRM){
         vtime += INTERVAL_MICRO;
-        threads_table[curr_thread].vtime += INTERVAL_MICRO;
+        threads_hot[curr_thread].vtime += INTERVAL_MICRO;
     }
     else if (signal == SIGINT){
-        alarm(0);
+        set_tick(0);
         void (*old_handler)(int) = old_sigaction.sa_handler;
         if(old_handler) old_handler(SIGINT);
         release_memory();
@@ -140,9 +1518,12 @@ void thread_signals_handler(int signal){
  * the different signals, but before, the SIGINT handler, if assigned, is
  * stored aside in case the updated handler wants to call it when
  * CTRL+C are pressed. the virtual timer is then set and started. the function
- * stores the context it was called from (for any future use) and then starts
- * the initial alarm signal (to invoke handler) and swaps the current
- * context with the first one in the table.
+ * stores the context it was called from and then starts the initial alarm
+ * signal (to invoke handler) and swaps the current context with the one of
+ * the thread at the head of the run queue (TID 0 if it was spawned first).
+ * once the last thread exits, the scheduler switches back to the stored
+ * context, so the timers are stopped and the original signal actions are
+ * restored before the function returns.
  */
 int ut_start(void){
     int error_count = 0;
@@ -151,18 +1532,69 @@ int ut_start(void){
     itv.it_interval.tv_sec = 0;
     itv.it_interval.tv_usec = INTERVAL_MILLI;
     itv.it_value = itv.it_interval;
-    sa.sa_flags = SA_RESTART;
-    if (sigfillset(&sa.sa_mask) == -1) return SYS_ERR;
-    sa.sa_handler = thread_signals_handler;
+    sa.sa_flags = SA_RESTART | SA_SIGINFO;
+    sa.sa_mask = sched_signals;
+    sa.sa_sigaction = thread_signals_handler;
+#ifdef PREEMPT_TRAMPOLINE
+    fpu_save_init();
+#endif
     if (setitimer(ITIMER_VIRTUAL, &itv, NULL) == -1) return SYS_ERR;
-    error_count += sigaction(SIGALRM, &sa, NULL);
-    error_count += sigaction(SIGVTALRM, &sa, NULL);
+    error_count += sigaction(SIGALRM, &sa, &old_alarm_action);
+    error_count += sigaction(SIGVTALRM, &sa, &old_vtalarm_action);
     error_count += sigaction(SIGINT, NULL, &old_sigaction);
     error_count += sigaction(SIGINT, &sa, NULL);
     if (error_count != 0) return SYS_ERR;
-    alarm(QUANTUM);
-    swapcontext(&uc_out, &(threads_table[0].uc));
-    return (SYS_ERR); /* if this line is ever reached, then swapcontext has failed */
+    ut_sched_lock();
+    worker = pthread_self();
+    on_worker = 1;
+    if (live_threads > 0){
+        set_running(NO_THREAD, dequeue(), 0);
+        ut_atomic_store(&started, 1, UT_RELAXED);
+        set_tick(quantum);
+        switch_context(&uc_out, &(threads_table[curr_thread].uc));
+        ut_atomic_store(&started, 0, UT_RELAXED);
+        set_tick(0);
+    }
+    itv.it_value.tv_usec = itv.it_interval.tv_usec = 0;
+    setitimer(ITIMER_VIRTUAL, &itv, NULL);
+    sigaction(SIGALRM, &old_alarm_action, NULL);
+    sigaction(SIGVTALRM, &old_vtalarm_action, NULL);
+    sigaction(SIGINT, &old_sigaction, NULL);
+    on_worker = 0;
+    ut_sched_unlock();
+    return 0;
+}
+
+unsigned long ut_get_switches(void){
+    return sched_stats.switches;
+}
+
+/*
+ * behaves as described in the header. the statistics are only written by
+ * the scheduler's kernel thread, so they are read without any locking.
+ */
+int ut_get_stats(tid_t tid, ut_stats_t *stats){
+    if (tid < 0 || tid >= threads_table_size)
+        return SYS_ERR;
+    *stats = threads_table[tid].stats;
+    return 0;
+}
+
+int ut_get_latency(tid_t tid, ut_hist_t *hist){
+    if (tid < 0 || tid >= threads_table_size)
+        return SYS_ERR;
+    *hist = threads_table[tid].latency;
+    return 0;
+}
+
+unsigned long long ut_get_latency_percentile(tid_t tid, double percentile){
+    if (tid < 0 || tid >= threads_table_size)
+        return 0;
+    return ut_hist_percentile(&(threads_table[tid].latency), percentile);
+}
+
+ut_sched_stats_t ut_get_sched_stats(void){
+    return sched_stats;
 }
 
 /*
@@ -171,7 +1603,7 @@ int ut_start(void){
  */
 unsigned long ut_get_vtime(tid_t tid){
     if (0 <= tid && tid < threads_table_size)
-        return threads_table[tid].vtime;
+        return threads_hot[tid].vtime;
     else
         return 0;
 }
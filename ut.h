@@ -7,37 +7,142 @@
 
    Description: this file defines a simple library for creating & scheduling
                 user-level threads.
-
-                           DO NOT CHANGE THIS FILE!
  ****************************************************************************/
 #ifndef _UT_H
 #define _UT_H
 
 #include <ucontext.h>
 
+#include "hist.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define MAX_TAB_SIZE 128 // the maximal threads table size.
 #define MIN_TAB_SIZE 2   // the minimal threads table size.
 
 #define SYS_ERR -1       // system-related failure code
 #define TAB_FULL -2      // full threads table failure code
+#define UT_CANCELED -8   // a blocking call was canceled (see ut_cancel)
+#define UT_TIMEDOUT -9   // a timed blocking call reached its deadline
+
+#define STACKSIZE 16384  // the default thread stack size (a preempted thread also
+                         // keeps a signal frame on its stack, which holds the whole
+                         // FPU state and takes a few KB on 64-bit builds).
+#define MIN_STACKSIZE 8192 // the smallest stack size ut_set_stack_policy() accepts.
+
+/* The stack policies (see ut_set_stack_policy). */
+#define UT_STACK_FIXED     0 // every thread gets the default stack size.
+#define UT_STACK_WATERMARK 1 // the same, and the stacks' peak usage is measured.
+#define UT_STACK_AUTO      2 // the stack size of a thread is picked by the usage
+                             // measured for the earlier threads of its function.
+
+/* The stack allocation flags (see ut_set_stack_alloc). */
+#define UT_STACK_MMAP      1 // stacks are reserved mappings, committed as touched.
+#define UT_STACK_RELEASE   2 // unused pages of mapped stacks are given back.
+#define UT_STACK_HUGE      4 // stacks are packed in huge pages of their own.
+
+#define UT_MAX_PAYLOAD 1024 // the largest payload ut_spawn_copy() copies to a stack.
 
-#define STACKSIZE 8192   // the thread stack size.
+#define UT_KEYS_MAX 128     // the number of thread-local keys (see ut_key_create).
+#define UT_KEYS_INLINE 8    // the first keys, whose values are kept in the slot itself.
+
+/* A thread-local key. */
+typedef int ut_key_t;
 
 /* The TID (thread ID) type. TID of a thread is actually the index of the thread in the
    threads table. */
 typedef short int tid_t;
 
+/* The thread states. A slot is UT_FREE until a thread is spawned into it, and returns to
+   UT_FREE once its function returns. */
+#define UT_FREE    0     // the slot holds no thread.
+#define UT_READY   1     // the thread waits in the run queue.
+#define UT_RUNNING 2     // the thread is the one currently executing.
+#define UT_BLOCKED 3     // the thread is parked until another thread unparks it.
+#define UT_EXITED  4     // the joinable thread returned, and its slot waits for ut_join().
+
 /*
-This type defines a single slot (entry) in the threads table. Each slot describes a single
-thread. Note that we don't need to keep the thread state since every thread is always ready
-or running. We also don't have to support adding/stopping thread dynamically, so we also don't
-have to manage free slots.
+The scheduling statistics of a single thread (see ut_get_stats). The times are in nanoseconds.
+*/
+typedef struct ut_stats {
+  unsigned long switch_ins;        // the number of times the thread was switched to.
+  unsigned long voluntary;         // switches away from the thread as it yielded, waited or exited.
+  unsigned long involuntary;       // switches away from the thread as it was preempted.
+  unsigned long long ready_ns;     // the time the thread was ready but waited for its turn.
+  unsigned long long blocked_ns;   // the time the thread was parked.
+} ut_stats_t;
+
+/*
+The attributes of a thread spawned by ut_spawn() or ut_spawn_copy() (see ut_attr_init).
+*/
+typedef struct ut_attr {
+  size_t stack_size;               // the size of the thread's stack, or 0 for the size the
+                                   // stack policy picks (see ut_set_stack_policy).
+  int joinable;                    // set if the thread's slot is kept once the thread
+                                   // exits, until ut_join() or ut_detach().
+} ut_attr_t;
+
+/*
+The statistics of the scheduler itself (see ut_get_sched_stats).
+*/
+typedef struct ut_sched_stats {
+  unsigned long ticks;             // the number of preemption ticks (SIGALRM) handled.
+  unsigned long switches;          // the number of context switches.
+  unsigned long long idle_ns;      // the time the scheduler waited for a ready thread.
+} ut_sched_stats_t;
+
+/* The size of a cache line, which the scheduling fields of the threads are laid out by. */
+#define UT_CACHE_LINE 64
+
+/*
+This type defines the scheduling fields of a single slot in the threads table: the ones the
+scheduler reads and writes as it moves threads between the run queue, the free slots list and
+the remote wakeups list, and as it scans the table. They are kept in an array of their own,
+apart from the rest of the slot (see ut_slot_t), and laid out in 32 bytes, so the array starts
+on a cache line and a line holds the fields of two whole slots. Ready threads are chained
+through the next field into the scheduler's run queue, and free slots are chained through the
+same field into the free slots list.
+*/
+typedef struct _ut_hot_slot {
+  unsigned long long since; // the time of the thread's last state change (in nanoseconds).
+  unsigned long vtime;  // the CPU time (in milliseconds) consumed by this thread.
+  int state;            // one of the thread states above.
+  int remote_next;      // the next slot in the remote wakeups list.
+  int remote_queued;    // set while the slot is in the remote wakeups list.
+  tid_t next;           // the next slot in the run queue or the free slots list.
+  char stack_released;  // set once the unused pages of a parked thread's stack
+                        // were given back.
+} __attribute__((aligned(32))) ut_hot_slot_t, *ut_hot_slot;
+
+/*
+This type defines the rest of a single slot (entry) in the threads table: the saved context
+and the stack of the thread, which are only touched when the thread is switched to or from,
+and the fields kept for the thread's function and for reporting. A slot keeps its stack after
+its thread exits, so the stack is reused by the next thread spawned into the slot.
 */
 typedef struct _ut_slot {
   ucontext_t uc;
-  unsigned long vtime;  // the CPU time (in milliseconds) consumed by this thread.
-  void (*func)(int);    // the function executed by the thread.
+  void (*func)(int);    // the function executed by a thread spawned by ut_spawn_thread.
   int arg;              // the function argument.
+  void (*fn)(void *);   // the function executed by a thread spawned by ut_spawn or
+                        // ut_spawn_copy (NULL for ut_spawn_thread).
+  void *fn_arg;         // its argument (the copy of the payload for ut_spawn_copy).
+  int joinable;         // set if the thread was spawned joinable and not detached since.
+  tid_t joiner;         // the thread waiting in ut_join() for this one, or -1.
+  void *stack;          // the thread's stack.
+  size_t stack_size;    // the size of the stack.
+  int watermarked;      // set if the stack's peak usage can be measured.
+  int stack_flags;      // the allocation flags the stack was allocated with.
+  char *park_sp;        // roughly where the stack pointer of a parked thread is.
+  ut_stats_t stats;     // the thread's scheduling statistics.
+  ut_hist_t latency;    // the wake-to-run latencies of the thread (in nanoseconds).
+  void *locals[UT_KEYS_INLINE]; // the values of the first thread-local keys.
+  void **spill;         // the values of the other keys, allocated on demand (or NULL).
+  int spill_size;       // the number of values spill holds.
+  int keyed;            // set once the thread set the value of a key.
+  int cancel_pending;   // set by ut_cancel() until a blocking call reports it.
 } ut_slot_t, *ut_slot;
 
 
@@ -60,9 +165,12 @@ int ut_init(int tab_size);
  thread context accordingly. This function DOES NOT cause the new thread to run.
  All threads start running only after ut_start() is called.
 
+ Threads may also be spawned by running threads after ut_start() was called, in
+ which case the new thread is appended to the run queue. When func returns, the
+ thread exits and its slot may be reused by a later spawn.
+
  Parameters:
-    func - a function to run in the new thread. We assume that the function is
-	infinite and gets a single int argument.
+    func - a function to run in the new thread, getting a single int argument.
 	arg - the argument for func.
 
  Returns:
@@ -73,26 +181,449 @@ int ut_init(int tab_size);
  ****************************************************************************/
 tid_t ut_spawn_thread(void (*func)(int), int arg);
 
+/*****************************************************************************
+ Initializes thread attributes to the defaults, which are the ones a thread
+ spawned with NULL attributes gets.
+ ****************************************************************************/
+void ut_attr_init(ut_attr_t *attr);
+
+/*****************************************************************************
+ Like ut_spawn_thread(), but the new thread's function takes a pointer, so
+ it may be passed any context, and the thread may get attributes of its own.
+
+ Parameters:
+    fn - a function to run in the new thread.
+    arg - the argument for fn.
+    attr - the attributes of the new thread, or NULL for the defaults.
+
+ Returns:
+    non-negative TID of the new thread - on success.
+    SYS_ERR - on system failure, or if the stack size in attr is below
+    MIN_STACKSIZE.
+    TAB_FULL - if the threads table is already full.
+ ****************************************************************************/
+tid_t ut_spawn(void (*fn)(void *), void *arg, const ut_attr_t *attr);
+
+/*****************************************************************************
+ Like ut_spawn(), but the argument is copied to the top of the new thread's
+ stack, and fn gets a pointer to the copy (aligned to 16 bytes). The copy
+ lives as long as the thread, so the caller's payload may be a local
+ variable, and no memory has to be allocated to pass the thread its context.
+ The copy takes room from the stack.
+
+ Parameters:
+    fn - a function to run in the new thread.
+    payload - the bytes to copy.
+    size - the number of bytes, at most UT_MAX_PAYLOAD.
+    attr - the attributes of the new thread, or NULL for the defaults.
+
+ Returns:
+    like ut_spawn(), and SYS_ERR if the payload is larger than UT_MAX_PAYLOAD.
+ ****************************************************************************/
+tid_t ut_spawn_copy(void (*fn)(void *), const void *payload, size_t size, const ut_attr_t *attr);
+
+/*****************************************************************************
+ Like ut_spawn_copy(), but instead of copying a payload, init constructs the
+ argument in the room reserved for it at the top of the new thread's stack.
+ This lets objects which cannot be copied bytewise (like C++ objects with
+ pointers into themselves) be moved to the new thread. init is called with
+ the scheduler lock held, before the new thread can run, so it should neither
+ block nor take long.
+
+ Parameters:
+    fn - a function to run in the new thread.
+    size - the room reserved for the argument, at most UT_MAX_PAYLOAD.
+    init - constructs the argument at place (16-byte aligned).
+    ctx - passed to init.
+    attr - the attributes of the new thread, or NULL for the defaults.
+
+ Returns:
+    like ut_spawn_copy().
+ ****************************************************************************/
+tid_t ut_spawn_emplace(void (*fn)(void *), size_t size, void (*init)(void *place, void *ctx),
+                       void *ctx, const ut_attr_t *attr);
+
+/*****************************************************************************
+ Waits for a joinable thread to exit, and frees its slot for later spawns. A
+ thread may only be joined once, by a single thread.
+
+ Parameters:
+    tid - the TID of a thread spawned joinable.
+
+ Returns:
+    0 - once the thread exited.
+    SYS_ERR - if the thread is not joinable (or was joined or detached
+    already), it is the calling thread itself, another thread is joining it,
+    or it is still running while the scheduler is not (so it never exits).
+ ****************************************************************************/
+int ut_join(tid_t tid);
+
+/*****************************************************************************
+ Makes a joinable thread unjoinable, so its slot is freed as soon as it exits
+ (right away if it exited already).
+
+ Parameters:
+    tid - the TID of a thread spawned joinable.
+
+ Returns:
+    0 - on success.
+    SYS_ERR - if the thread is not joinable, or another thread is joining it.
+ ****************************************************************************/
+int ut_detach(tid_t tid);
+
 
 /*****************************************************************************
  Starts running the threads, previously created by ut_spawn_thread. Sets the
- scheduler to switch between threads every second (this is done by registering
- the scheduler function as a signal handler for SIGALRM, and causing SIGALRM to
- arrive every second). Also starts the timer used to collect the threads CPU usage
- statistics and establishes an appropriate handler for SIGVTALRM,issued by the
- timer.
+ scheduler to switch between threads every quantum, a second unless changed by
+ ut_set_quantum() (this is done by registering the scheduler function as a
+ signal handler for SIGALRM, and causing SIGALRM to arrive every quantum).
+ Also starts the timer used to collect the threads CPU usage statistics and
+ establishes an appropriate handler for SIGVTALRM,issued by the timer.
  The first thread to run is the thread with TID 0.
 
  Parameters:
     None.
 
  Returns:
+    0 - once every spawned thread has exited. The timers are stopped and the
+    original actions of the three signals restored by then.
     SYS_ERR - on system failure (like failure to establish a signal handler).
-    Under normal operation, this function should start executing threads and
-	never return.
+    As long as some thread is alive, this function does not return.
  ****************************************************************************/
 int ut_start(void);
 
+/*****************************************************************************
+ Sets the time slice a thread runs before it is preempted. May be called
+ before or after ut_start(); a change takes effect from the next preemption.
+
+ Parameters:
+    usec - the new quantum, in microseconds (the default is 1000000).
+
+ Returns:
+    0 - on success.
+    SYS_ERR - if usec is 0.
+ ****************************************************************************/
+int ut_set_quantum(unsigned long usec);
+
+/*****************************************************************************
+ Sets how the stacks of the threads spawned from now on are sized.
+ Under UT_STACK_WATERMARK and UT_STACK_AUTO, a new stack is filled with a
+ pattern, so its peak usage can be measured by finding the deepest word the
+ pattern was overwritten in (which costs a pass over the stack at spawn). A
+ mapped stack (see ut_set_stack_alloc) is not filled, since that would commit
+ all of its pages; its usage is measured by its lowest resident page instead,
+ and a mapped stack reused by a new thread gives its pages back first. The
+ peak usage of every thread is also recorded for its function when it exits.
+ Under UT_STACK_AUTO, a thread whose function was recorded before gets the
+ size ut_stack_recommend() returns for the function, instead of the default.
+
+ Parameters:
+    policy - one of the stack policies above.
+    size - the default stack size, in bytes, or 0 for STACKSIZE.
+
+ Returns:
+    0 - on success.
+    SYS_ERR - if the policy is unknown, or the size is below MIN_STACKSIZE.
+ ****************************************************************************/
+int ut_set_stack_policy(int policy, size_t size);
+
+/*****************************************************************************
+ Sets how the stacks of the threads spawned from now on are allocated. By
+ default, stacks are blocks of the library's arena (see ut_alloc). With
+ UT_STACK_MMAP, every stack is a mapping
+ of its own, reserved without committing memory: its pages only take memory
+ once the thread touches them, so large stacks (say 1MB, set by
+ ut_set_stack_policy) cost little for threads which rarely recurse deeply, and
+ an inaccessible page below the stack turns an overflow into a segmentation
+ fault. With UT_STACK_RELEASE too, the pages of a mapped stack below the
+ thread's current frame are given back to the kernel when the thread exits,
+ and when it has been parked for at least idle_usec microseconds (checked at
+ the preemption ticks), so the resident memory follows the actual use.
+ With UT_STACK_HUGE, the stacks are packed next to each other in a pool of
+ 2MB regions of their own, backed by huge pages when the system allows it,
+ so switching between many threads takes few TLB entries. Only the lowest
+ stack of every region is guarded against overflows, by an inaccessible page
+ below the region.
+
+ Parameters:
+    flags - 0 for arena stacks, UT_STACK_HUGE for pooled stacks, or
+    UT_STACK_MMAP, optionally with UT_STACK_RELEASE.
+    idle_usec - how long a thread is parked before its stack is released.
+
+ Returns:
+    0 - on success.
+    SYS_ERR - if the flags are not one of the combinations above.
+ ****************************************************************************/
+int ut_set_stack_alloc(int flags, unsigned long idle_usec);
+
+/*****************************************************************************
+ Allocates memory from the library's arena, which also holds the threads
+ table and the stacks: large contiguous regions, backed by huge pages when the
+ system allows it. This suits the threads' shared state (like semaphores) and
+ per-thread state, which then lies next to the rest of the library's data.
+ The memory cannot be freed by itself; it is all released together with the
+ threads table, by a later ut_init() or on SIGINT. Should be called after
+ ut_init(), by the kernel thread running the scheduler.
+
+ Parameters:
+    size - the size of the memory, in bytes.
+
+ Returns:
+    the memory, zero filled and aligned for any type, or NULL on failure.
+ ****************************************************************************/
+void *ut_alloc(size_t size);
+
+/*****************************************************************************
+ Returns the peak stack usage of a thread, in bytes: the deepest point its
+ stack reached so far, or before it exited (until its slot is reused).
+
+ Parameters:
+    tid - a thread ID.
+
+ Returns:
+    the peak usage - on success.
+    SYS_ERR - if tid is outside the threads table, or the thread's stack was
+    not filled with the pattern (see ut_set_stack_policy).
+ ****************************************************************************/
+long ut_stack_usage(tid_t tid);
+
+/*****************************************************************************
+ Returns the size of a thread's stack, and how much of it is resident in
+ memory. Only the stack's own pages are counted, unlike the growth of the
+ resident size of the process, which depends on whatever else shares the
+ huge pages of the arena. A part of the stack in a huge page is resident as
+ soon as any of the huge page was touched.
+
+ Parameters:
+    tid - a thread ID.
+    resident - where to store the resident bytes of the stack (may be NULL).
+
+ Returns:
+    the size of the stack - on success.
+    SYS_ERR - if tid is outside the threads table, or its slot has no stack.
+ ****************************************************************************/
+long ut_stack_memory(tid_t tid, long *resident);
+
+/*****************************************************************************
+ Returns the stack size recommended for the threads running a function: half
+ again the peak usage recorded for its earlier threads, plus room for a
+ signal frame, in whole pages and never below MIN_STACKSIZE.
+
+ Parameters:
+    func - a thread function.
+
+ Returns:
+    the recommended size, or 0 if no thread running func was recorded.
+ ****************************************************************************/
+size_t ut_stack_recommend(void (*func)(int));
+
+/*****************************************************************************
+ Returns the TID of the calling thread.
+
+ Parameters:
+    None.
+
+ Returns:
+	the TID of the running thread, or -1 if the scheduler is not running.
+ ****************************************************************************/
+tid_t ut_self(void);
+
+/*****************************************************************************
+ Gives up the rest of the calling thread's quantum. The thread is moved to the
+ tail of the run queue and the next ready thread runs. If no other thread is
+ ready, the calling thread simply continues.
+
+ Parameters:
+    None.
+ ****************************************************************************/
+void ut_yield(void);
+
+/*****************************************************************************
+ Blocks the calling thread for at least the given number of microseconds,
+ while the other threads run. The wakeup is checked at every switch and tick,
+ and by the scheduler while it is idle, so a sleep overshoots by up to a
+ quantum when other threads keep running without switching.
+
+ Parameters:
+    usec - the time to sleep, in microseconds.
+
+ Returns:
+    0 - on success.
+    UT_CANCELED - if the thread was canceled (see ut_cancel).
+    SYS_ERR - on system failure, or if the scheduler is not running.
+ ****************************************************************************/
+int ut_sleep(unsigned long usec);
+
+/*****************************************************************************
+ Asks a thread to stop waiting. Cancellation is cooperative: the next
+ cancelable blocking call of the thread (the one it waits in now, if any)
+ returns UT_CANCELED instead of waiting, which consumes the request, and the
+ thread is expected to give up the work it was doing. The cancelable calls
+ are ut_sleep(), binsem_down() and ut_mutex_lock(), the condition variable
+ waits, the channel sends and receives, and their timed variants; the other
+ blocking calls keep waiting, and leave the request pending. A thread busy
+ computing can poll for a request with ut_testcancel().
+
+ Parameters:
+    tid - the thread to cancel.
+
+ Returns:
+    0 - on success.
+    SYS_ERR - if no thread runs in tid.
+ ****************************************************************************/
+int ut_cancel(tid_t tid);
+
+/*****************************************************************************
+ Returns 1 (and consumes the request) if the calling thread was canceled,
+ and 0 otherwise.
+ ****************************************************************************/
+int ut_testcancel(void);
+
+/*****************************************************************************
+ Blocks the calling thread until a file descriptor is ready, while the other
+ threads run. The threads waiting for file descriptors are served by one
+ poll(2) of all their descriptors, at every switch and tick, and by the
+ scheduler while it is idle. Use it before a read or a write which could
+ block, so the call does not stop the whole scheduler.
+
+ Parameters:
+    fd - the file descriptor.
+    events - the events to wait for, as for poll(2) (POLLIN, POLLOUT).
+
+ Returns:
+    the events which occurred (may include POLLERR, POLLHUP or POLLNVAL) - on
+    success.
+    SYS_ERR - on system failure, or if the scheduler is not running.
+ ****************************************************************************/
+int ut_wait_fd(int fd, int events);
+
+/*****************************************************************************
+ Creates a thread-local key: every thread has a value of its own for the key,
+ NULL until the thread sets it. Unlike __thread variables, which are shared
+ by all the user-level threads of the kernel thread, a value belongs to the
+ user-level thread. The first UT_KEYS_INLINE keys keep their values in the
+ threads table itself; the values of the other keys are held by a table the
+ thread allocates the first time it sets one.
+ When a thread exits, the destructor of every key whose value is not NULL is
+ called with the value (which is set to NULL first), in the exiting thread.
+ Destructors which set values again are called for them again, up to 4
+ rounds.
+
+ Parameters:
+    key - where the new key is stored.
+    destructor - called with a thread's value at its exit, or NULL.
+
+ Returns:
+    0 - on success.
+    SYS_ERR - if UT_KEYS_MAX keys exist already.
+ ****************************************************************************/
+int ut_key_create(ut_key_t *key, void (*destructor)(void *));
+
+/*****************************************************************************
+ Deletes a thread-local key. The values of the threads are dropped without
+ calling the destructor, so the key can be created again with NULL values.
+
+ Returns:
+    0 - on success.
+    SYS_ERR - if key was not created.
+ ****************************************************************************/
+int ut_key_delete(ut_key_t key);
+
+/*****************************************************************************
+ Returns the calling thread's value of a key, or NULL if it did not set it
+ (or if the caller is not a user-level thread). Reading a key below
+ UT_KEYS_INLINE costs a couple of loads.
+ ****************************************************************************/
+void *ut_getspecific(ut_key_t key);
+
+/*****************************************************************************
+ Sets the calling thread's value of a key.
+
+ Returns:
+    0 - on success.
+    SYS_ERR - if key was not created, if the caller is not a user-level
+    thread, or if the table of values could not be allocated.
+ ****************************************************************************/
+int ut_setspecific(ut_key_t key, const void *value);
+
+/*****************************************************************************
+ Disables and re-enables the preemption of the calling thread, so a short
+ critical section (among user-level threads) can be protected without a
+ semaphore. Calls may be nested, and preemption is enabled again once every
+ ut_preempt_disable() call is matched by a ut_preempt_enable() call. A
+ preemption that became due in the meanwhile takes place at that point.
+ The state belongs to the thread: if the thread waits (on a semaphore, for
+ example) inside the section, the other threads run normally until it
+ resumes with preemption still disabled.
+ Both calls only update a counter (and the second checks a flag), and cost
+ no system call.
+
+ Parameters:
+    None.
+ ****************************************************************************/
+void ut_preempt_disable(void);
+void ut_preempt_enable(void);
+
+/*****************************************************************************
+ Returns the number of context switches made by the scheduler since ut_init()
+ was called (including the switches into and out of ut_start()).
+
+ Parameters:
+    None.
+ ****************************************************************************/
+unsigned long ut_get_switches(void);
+
+/*****************************************************************************
+ Copies the scheduling statistics of a thread. The statistics are collected by
+ the scheduler without any locking, so when the call races with the scheduler
+ the fields may be off by the last switch. A thread's statistics start over
+ when it is spawned, and are kept after it exits until its slot is reused.
+
+ Parameters:
+    tid - a thread ID.
+    stats - the structure to fill.
+
+ Returns:
+    0 - on success.
+    SYS_ERR - if tid is outside the threads table.
+ ****************************************************************************/
+int ut_get_stats(tid_t tid, ut_stats_t *stats);
+
+/*****************************************************************************
+ Copies the histogram of a thread's wake-to-run latencies: the time from
+ every point the thread became ready (spawned, unparked, or put back in the
+ run queue by a yield or a preemption) to the point it ran, in nanoseconds.
+ Like the other statistics, it starts over when the thread is spawned.
+
+ Parameters:
+    tid - a thread ID.
+    hist - the histogram to fill (see hist.h for reading it).
+
+ Returns:
+    0 - on success.
+    SYS_ERR - if tid is outside the threads table.
+ ****************************************************************************/
+int ut_get_latency(tid_t tid, ut_hist_t *hist);
+
+/*****************************************************************************
+ Returns a percentile of a thread's wake-to-run latencies, in nanoseconds, or
+ 0 if tid is outside the threads table or the thread never waited to run.
+
+ Parameters:
+    tid - a thread ID.
+    percentile - between 0 and 100 (like 50 for the median, or 99.9).
+ ****************************************************************************/
+unsigned long long ut_get_latency_percentile(tid_t tid, double percentile);
+
+/*****************************************************************************
+ Returns the statistics of the scheduler since ut_init() was called, collected
+ just like the threads' statistics.
+
+ Parameters:
+    None.
+ ****************************************************************************/
+ut_sched_stats_t ut_get_sched_stats(void);
+
 /*****************************************************************************
  Returns the CPU-time consumed by the given thread.
 
@@ -104,4 +635,8 @@ int ut_start(void);
  ****************************************************************************/
 unsigned long ut_get_vtime(tid_t tid);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
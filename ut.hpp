@@ -0,0 +1,300 @@
+/*****************************************************************************
+   File:        ut.hpp
+
+   Description: this file defines a C++17 interface to the user-level threads
+                library, on top of ut.h, binsem.h and mutex.h:
+                  ut::thread - spawns a thread running any callable with any
+                  arguments, as std::thread does. The callable and copies of
+                  the arguments are moved right onto the new thread's stack
+                  (see ut_spawn_emplace), so spawning allocates no memory of
+                  its own as long as they fit in UT_MAX_PAYLOAD bytes and
+                  cannot throw when moved; other ones are allocated on the
+                  heap. The handle is move-only, and must be joined or
+                  detached before it is destroyed.
+                  ut::mutex, ut::lock_guard - a mutex and its scoped lock.
+                  ut::binary_semaphore, ut::semaphore_guard - a semaphore and
+                  a scoped down()/up() pair.
+                  ut::this_thread - the calling thread's TID, and yield().
+                Failures are thrown as std::system_error. An exception which
+                escapes a thread's callable calls std::terminate(), as with
+                std::thread.
+ ****************************************************************************/
+#ifndef _UT_HPP
+#define _UT_HPP
+
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <new>
+#include <system_error>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "binsem.h"
+#include "mutex.h"
+#include "ut.h"
+
+namespace ut {
+
+namespace detail {
+
+[[noreturn]] inline void fail(std::errc error, const char *what){
+  throw std::system_error(std::make_error_code(error), what);
+}
+
+/*
+ * a thread's callable with the decayed copies of its arguments, which are
+ * passed to it as rvalues (like std::thread does).
+ */
+template <class F, class... Args>
+class closure {
+public:
+  template <class G, class... A>
+  explicit closure(G &&f, A &&...args)
+    : call_(std::forward<G>(f), std::forward<A>(args)...) {}
+
+  void operator()(){
+    std::apply([](auto &&f, auto &&...args){
+      std::invoke(std::move(f), std::move(args)...);
+    }, std::move(call_));
+  }
+
+private:
+  std::tuple<F, Args...> call_;
+};
+
+/*
+ * whether a closure is kept on its thread's stack rather than on the heap.
+ * it is moved there with the scheduler lock held (see ut_spawn_emplace),
+ * where an exception could not be thrown back to the spawning thread, so
+ * only a closure whose move cannot throw qualifies.
+ */
+template <class C>
+constexpr bool on_stack = sizeof(C) <= UT_MAX_PAYLOAD && alignof(C) <= 16 &&
+                          std::is_nothrow_move_constructible_v<C>;
+
+/*
+ * moves a closure the spawning thread constructed to its place on the new
+ * thread's stack.
+ */
+template <class C>
+void relocate(void *place, void *c) noexcept {
+  ::new (place) C(std::move(*static_cast<C *>(c)));
+}
+
+template <class C>
+void run_on_stack(void *place) noexcept {
+  C *c = static_cast<C *>(place);
+  (*c)();
+  c->~C();
+}
+
+template <class C>
+void run_on_heap(void *p) noexcept {
+  C *c = static_cast<C *>(p);
+  (*c)();
+  delete c;
+}
+
+} // namespace detail
+
+/*****************************************************************************
+  The attributes of a ut::thread (see ut_attr_t).
+*****************************************************************************/
+class attributes {
+public:
+  attributes() noexcept { ut_attr_init(&attr_); }
+
+  attributes &stack_size(std::size_t size) noexcept {
+    attr_.stack_size = size;
+    return *this;
+  }
+
+  const ut_attr_t *native_handle() const noexcept { return &attr_; }
+
+private:
+  ut_attr_t attr_;
+};
+
+/*****************************************************************************
+  A handle to a user-level thread, spawned joinable.
+*****************************************************************************/
+class thread {
+public:
+  using id = tid_t;
+
+  thread() noexcept : tid_(-1) {}
+
+  template <class F, class... Args,
+            class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, thread> &&
+                                     !std::is_same_v<std::decay_t<F>, attributes>>>
+  explicit thread(F &&f, Args &&...args)
+    : thread(attributes(), std::forward<F>(f), std::forward<Args>(args)...) {}
+
+  template <class F, class... Args>
+  thread(const attributes &attr, F &&f, Args &&...args) : tid_(-1) {
+    using C = detail::closure<std::decay_t<F>, std::decay_t<Args>...>;
+    ut_attr_t a = *attr.native_handle();
+    a.joinable = 1;
+    if constexpr (detail::on_stack<C>){
+      C c(std::forward<F>(f), std::forward<Args>(args)...);
+      tid_ = ut_spawn_emplace(detail::run_on_stack<C>, sizeof(C), detail::relocate<C>, &c, &a);
+    }
+    else {
+      C *c = new C(std::forward<F>(f), std::forward<Args>(args)...);
+      if ((tid_ = ut_spawn(detail::run_on_heap<C>, c, &a)) < 0)
+        delete c;
+    }
+    if (tid_ == TAB_FULL)
+      detail::fail(std::errc::resource_unavailable_try_again, "ut::thread");
+    if (tid_ < 0)
+      detail::fail(std::errc::not_enough_memory, "ut::thread");
+  }
+
+  thread(const thread &) = delete;
+  thread &operator=(const thread &) = delete;
+
+  thread(thread &&other) noexcept : tid_(std::exchange(other.tid_, -1)) {}
+
+  thread &operator=(thread &&other) noexcept {
+    if (joinable())
+      std::terminate();
+    tid_ = std::exchange(other.tid_, -1);
+    return *this;
+  }
+
+  ~thread(){
+    if (joinable())
+      std::terminate();
+  }
+
+  bool joinable() const noexcept { return tid_ >= 0; }
+
+  id get_id() const noexcept { return tid_; }
+
+  void swap(thread &other) noexcept { std::swap(tid_, other.tid_); }
+
+  /*
+   * waits for the thread to exit (see ut_join).
+   */
+  void join(){
+    if (!joinable())
+      detail::fail(std::errc::invalid_argument, "ut::thread::join");
+    if (tid_ == ut_self())
+      detail::fail(std::errc::resource_deadlock_would_occur, "ut::thread::join");
+    if (ut_join(tid_) != 0)
+      detail::fail(std::errc::invalid_argument, "ut::thread::join");
+    tid_ = -1;
+  }
+
+  void detach(){
+    if (!joinable() || ut_detach(tid_) != 0)
+      detail::fail(std::errc::invalid_argument, "ut::thread::detach");
+    tid_ = -1;
+  }
+
+private:
+  id tid_;
+};
+
+namespace this_thread {
+
+inline thread::id get_id() noexcept { return ut_self(); }
+
+inline void yield() noexcept { ut_yield(); }
+
+} // namespace this_thread
+
+/*****************************************************************************
+  A mutex (see mutex.h), which meets the C++ Lockable requirements.
+*****************************************************************************/
+class mutex {
+public:
+  mutex() noexcept { ut_mutex_init(&m_); }
+
+  mutex(const mutex &) = delete;
+  mutex &operator=(const mutex &) = delete;
+
+  void lock(){
+    if (ut_mutex_lock(&m_) != 0)
+      detail::fail(std::errc::operation_not_permitted, "ut::mutex::lock");
+  }
+
+  bool try_lock() noexcept { return ut_mutex_trylock(&m_) == 0; }
+
+  void unlock() noexcept { ut_mutex_unlock(&m_); }
+
+  ut_mutex_t *native_handle() noexcept { return &m_; }
+
+private:
+  ut_mutex_t m_;
+};
+
+struct adopt_lock_t { explicit adopt_lock_t() = default; };
+inline constexpr adopt_lock_t adopt_lock{};
+
+/*****************************************************************************
+  Holds a lock on a mutex (or anything with lock() and unlock()) for its
+  scope.
+*****************************************************************************/
+template <class Mutex>
+class lock_guard {
+public:
+  explicit lock_guard(Mutex &m) : m_(m) { m_.lock(); }
+
+  lock_guard(Mutex &m, adopt_lock_t) noexcept : m_(m) {}
+
+  lock_guard(const lock_guard &) = delete;
+  lock_guard &operator=(const lock_guard &) = delete;
+
+  ~lock_guard(){ m_.unlock(); }
+
+private:
+  Mutex &m_;
+};
+
+/*****************************************************************************
+  A binary semaphore (see binsem.h), named after std::binary_semaphore.
+*****************************************************************************/
+class binary_semaphore {
+public:
+  explicit binary_semaphore(int initial) noexcept { binsem_init(&s_, initial); }
+
+  binary_semaphore(const binary_semaphore &) = delete;
+  binary_semaphore &operator=(const binary_semaphore &) = delete;
+
+  void release() noexcept { binsem_up(&s_); }
+
+  void acquire(){
+    if (binsem_down(&s_) != 0)
+      detail::fail(std::errc::operation_not_permitted, "ut::binary_semaphore::acquire");
+  }
+
+  bool try_acquire() noexcept { return binsem_trydown(&s_) == 1; }
+
+  sem_t *native_handle() noexcept { return &s_; }
+
+private:
+  sem_t s_;
+};
+
+/*****************************************************************************
+  Lowers a semaphore for its scope, and raises it back at the end.
+*****************************************************************************/
+class semaphore_guard {
+public:
+  explicit semaphore_guard(binary_semaphore &s) : s_(s) { s_.acquire(); }
+
+  semaphore_guard(const semaphore_guard &) = delete;
+  semaphore_guard &operator=(const semaphore_guard &) = delete;
+
+  ~semaphore_guard(){ s_.release(); }
+
+private:
+  binary_semaphore &s_;
+};
+
+} // namespace ut
+
+#endif
@@ -0,0 +1,491 @@
+/*****************************************************************************
+   File:        ut_co.hpp
+
+   Description: this file defines C++20 coroutines on top of the user-level
+                threads library, which share its scheduler with the stackful
+                threads:
+                  ut::task<T> - a lazily started coroutine returning a T,
+                  which runs when it is co_awaited (its awaiter is resumed
+                  right when it returns, without going through a queue).
+                  ut::co_spawn() - starts a top-level task<void>, detached.
+                  ut::sleep(), ut::wait_fd(), ut::read(), ut::write(),
+                  ut::async_semaphore::down() - awaitables which suspend the
+                  coroutine until a timer, a file descriptor or a semaphore
+                  wakes it.
+                The coroutines run on the executor: a user-level thread which
+                resumes the ready coroutines in turn, parks while there is
+                none, and exits once every spawned task returned (a later
+                co_spawn() spawns it again). Timers and file descriptor waits
+                are the scheduler's own (see ut_sched.h), so ut::sleep() and
+                ut_sleep(), or ut::read() and ut_wait_fd(), are served by the
+                same timers heap and the same poll, and an async_semaphore may
+                be shared by coroutines and threads.
+                Every awaitable must be co_awaited by a coroutine running on
+                the executor, that is, one started by co_spawn() or awaited
+                by such a coroutine. A coroutine runs until it suspends or
+                the executor thread is preempted, so it should not make
+                blocking calls (a blocking call of a thread, like
+                binsem_down(), blocks every coroutine).
+                An exception which escapes a spawned task calls
+                std::terminate(), as with ut::thread.
+ ****************************************************************************/
+#ifndef _UT_CO_HPP
+#define _UT_CO_HPP
+
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <utility>
+
+#include <poll.h>
+#include <unistd.h>
+
+#include "ut.hpp"
+#include "ut_sched.h"
+
+namespace ut {
+
+template <class T = void>
+class task;
+
+namespace detail {
+
+/*
+ * a suspended coroutine, queued in the executor once it may resume.
+ */
+struct ready_node {
+  ready_node *next = nullptr;
+  std::coroutine_handle<> handle;
+};
+
+/*
+ * the thread which resumes the coroutines. its queue and counter are
+ * protected by the scheduler lock, since the awaitables' callbacks run with
+ * the lock held (the timer callbacks possibly in the signal handler).
+ */
+class executor {
+public:
+  static constexpr std::size_t stack_size = 65536;
+
+  static executor &instance() noexcept {
+    static executor e;
+    return e;
+  }
+
+  /*
+   * queues a coroutine to resume. called with the scheduler lock held.
+   */
+  void post(ready_node *node) noexcept {
+    node->next = nullptr;
+    if (tail_)
+      tail_->next = node;
+    else
+      head_ = node;
+    tail_ = node;
+    if (tid_ >= 0)
+      ut_unpark(tid_);
+  }
+
+  /*
+   * queues a new top-level task, and spawns the executor thread if it is
+   * not running. returns false if it could not be spawned.
+   */
+  bool start(ready_node *node) noexcept {
+    ut_attr_t attr;
+    bool ok = true;
+    ut_sched_lock();
+    if (tid_ < 0){
+      ut_attr_init(&attr);
+      attr.stack_size = stack_size;
+      if ((tid_ = ut_spawn(run, this, &attr)) < 0){
+        tid_ = -1;
+        ok = false;
+      }
+    }
+    if (ok){
+      tasks_++;
+      post(node);
+    }
+    ut_sched_unlock();
+    return ok;
+  }
+
+  void finished() noexcept {
+    ut_sched_lock();
+    tasks_--;
+    ut_sched_unlock();
+  }
+
+private:
+  executor() = default;
+
+  static void run(void *arg) noexcept {
+    executor *e = static_cast<executor *>(arg);
+    ready_node *node;
+    ut_sched_lock();
+    for (;;){
+      while ((node = e->head_)){
+        if (!(e->head_ = node->next))
+          e->tail_ = nullptr;
+        ut_sched_unlock();
+        node->handle.resume();
+        ut_sched_lock();
+      }
+      if (e->tasks_ == 0 || ut_park() != 0)
+        break;
+    }
+    e->tid_ = -1;
+    ut_sched_unlock();
+  }
+
+  ready_node *head_ = nullptr, *tail_ = nullptr;
+  tid_t tid_ = -1;
+  long tasks_ = 0; // the spawned tasks which have not returned yet.
+};
+
+/*
+ * the parts of a task's promise which do not depend on its result. the
+ * final suspension transfers control right to the awaiting coroutine.
+ */
+class promise_base {
+public:
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  struct final_awaiter {
+    bool await_ready() noexcept { return false; }
+
+    template <class P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+      return h.promise().continuation_;
+    }
+
+    void await_resume() noexcept {}
+  };
+
+  final_awaiter final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() noexcept { error_ = std::current_exception(); }
+
+  void set_continuation(std::coroutine_handle<> h) noexcept { continuation_ = h; }
+
+protected:
+  void rethrow() const {
+    if (error_)
+      std::rethrow_exception(error_);
+  }
+
+private:
+  std::coroutine_handle<> continuation_ = std::noop_coroutine();
+  std::exception_ptr error_;
+};
+
+template <class T>
+class promise : public promise_base {
+public:
+  task<T> get_return_object() noexcept;
+
+  template <class U>
+  void return_value(U &&value){ value_.emplace(std::forward<U>(value)); }
+
+  T result(){
+    rethrow();
+    return std::move(*value_);
+  }
+
+private:
+  std::optional<T> value_;
+};
+
+template <>
+class promise<void> : public promise_base {
+public:
+  task<void> get_return_object() noexcept;
+
+  void return_void() noexcept {}
+
+  void result(){ rethrow(); }
+};
+
+/*
+ * the coroutine co_spawn() wraps a task in: it is what the executor queues
+ * first, and it frees itself once the task returned.
+ */
+struct root {
+  struct promise_type {
+    ready_node node;
+
+    root get_return_object() noexcept {
+      return root{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    std::suspend_never final_suspend() noexcept {
+      executor::instance().finished();
+      return {};
+    }
+
+    void return_void() noexcept {}
+
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+} // namespace detail
+
+/*****************************************************************************
+  A coroutine returning a T, which starts when it is co_awaited. The awaiting
+  coroutine gets its result (or its exception) back.
+*****************************************************************************/
+template <class T>
+class [[nodiscard]] task {
+public:
+  using promise_type = detail::promise<T>;
+
+  task(task &&other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+
+  task &operator=(task &&other) noexcept {
+    if (this != &other){
+      if (h_)
+        h_.destroy();
+      h_ = std::exchange(other.h_, nullptr);
+    }
+    return *this;
+  }
+
+  ~task(){
+    if (h_)
+      h_.destroy();
+  }
+
+  auto operator co_await() noexcept {
+    struct awaiter {
+      std::coroutine_handle<promise_type> h;
+
+      bool await_ready() noexcept { return false; }
+
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        h.promise().set_continuation(caller);
+        return h;
+      }
+
+      T await_resume(){ return h.promise().result(); }
+    };
+    return awaiter{h_};
+  }
+
+private:
+  friend promise_type;
+
+  explicit task(std::coroutine_handle<promise_type> h) noexcept : h_(h) {}
+
+  std::coroutine_handle<promise_type> h_;
+};
+
+namespace detail {
+
+template <class T>
+task<T> promise<T>::get_return_object() noexcept {
+  return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object() noexcept {
+  return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+inline root run_root(task<void> t){
+  co_await std::move(t);
+}
+
+} // namespace detail
+
+/*****************************************************************************
+  Starts a task on the executor, detached. It first runs once the executor
+  thread is scheduled, so co_spawn() may be called before ut_start(), and by
+  threads and coroutines alike.
+*****************************************************************************/
+inline void co_spawn(task<void> t){
+  auto h = detail::run_root(std::move(t)).handle;
+  h.promise().node.handle = h;
+  if (!detail::executor::instance().start(&h.promise().node)){
+    h.destroy();
+    detail::fail(std::errc::resource_unavailable_try_again, "ut::co_spawn");
+  }
+}
+
+/*****************************************************************************
+  Suspends the coroutine for at least the given time (see ut_sleep).
+*****************************************************************************/
+class sleep_awaiter {
+public:
+  explicit sleep_awaiter(unsigned long long ns) noexcept : ns_(ns) {}
+
+  bool await_ready() const noexcept { return ns_ == 0; }
+
+  void await_suspend(std::coroutine_handle<> h){
+    int ret;
+    timer_.ready.handle = h;
+    timer_.fire = fire;
+    timer_.tid = -1;
+    timer_.index = -1;
+    ut_sched_lock();
+    timer_.deadline = ut_clock() + ns_;
+    ret = ut_timer_start(&timer_);
+    ut_sched_unlock();
+    if (ret != 0)
+      detail::fail(std::errc::not_enough_memory, "ut::sleep");
+  }
+
+  void await_resume() noexcept {}
+
+private:
+  struct timer : ut_timer_t {
+    detail::ready_node ready;
+  };
+
+  static void fire(ut_timer_t *t) noexcept {
+    detail::executor::instance().post(&static_cast<timer *>(t)->ready);
+  }
+
+  timer timer_;
+  unsigned long long ns_;
+};
+
+template <class Rep, class Period>
+sleep_awaiter sleep(std::chrono::duration<Rep, Period> d) noexcept {
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+  return sleep_awaiter(ns > 0 ? ns : 0);
+}
+
+/*****************************************************************************
+  Suspends the coroutine until a file descriptor is ready (see ut_wait_fd).
+  co_await gives the events which occurred.
+*****************************************************************************/
+class fd_awaiter {
+public:
+  fd_awaiter(int fd, int events) noexcept {
+    wait_.fd = fd;
+    wait_.events = events;
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> h){
+    int ret;
+    wait_.ready.handle = h;
+    wait_.revents = 0;
+    wait_.fire = fire;
+    wait_.tid = -1;
+    wait_.index = -1;
+    ut_sched_lock();
+    ret = ut_io_start(&wait_);
+    ut_sched_unlock();
+    if (ret != 0)
+      detail::fail(std::errc::not_enough_memory, "ut::wait_fd");
+  }
+
+  int await_resume() const noexcept { return wait_.revents; }
+
+protected:
+  int fd() const noexcept { return wait_.fd; }
+
+private:
+  struct io_wait : ut_io_wait_t {
+    detail::ready_node ready;
+  };
+
+  static void fire(ut_io_wait_t *w) noexcept {
+    detail::executor::instance().post(&static_cast<io_wait *>(w)->ready);
+  }
+
+  io_wait wait_;
+};
+
+inline fd_awaiter wait_fd(int fd, int events) noexcept {
+  return fd_awaiter(fd, events);
+}
+
+/*****************************************************************************
+  Waits for a file descriptor to be readable (writable), and then reads
+  (writes) it once. co_await gives the result of read(2) (write(2)).
+*****************************************************************************/
+class read_awaiter : public fd_awaiter {
+public:
+  read_awaiter(int fd, void *buf, std::size_t count) noexcept
+    : fd_awaiter(fd, POLLIN), buf_(buf), count_(count) {}
+
+  ssize_t await_resume() const noexcept { return ::read(fd(), buf_, count_); }
+
+private:
+  void *buf_;
+  std::size_t count_;
+};
+
+class write_awaiter : public fd_awaiter {
+public:
+  write_awaiter(int fd, const void *buf, std::size_t count) noexcept
+    : fd_awaiter(fd, POLLOUT), buf_(buf), count_(count) {}
+
+  ssize_t await_resume() const noexcept { return ::write(fd(), buf_, count_); }
+
+private:
+  const void *buf_;
+  std::size_t count_;
+};
+
+inline read_awaiter read(int fd, void *buf, std::size_t count) noexcept {
+  return read_awaiter(fd, buf, count);
+}
+
+inline write_awaiter write(int fd, const void *buf, std::size_t count) noexcept {
+  return write_awaiter(fd, buf, count);
+}
+
+/*****************************************************************************
+  A binary semaphore which coroutines lower with co_await down() (see
+  binsem_down_async), while threads may still use acquire() on it.
+*****************************************************************************/
+class async_semaphore : public binary_semaphore {
+public:
+  using binary_semaphore::binary_semaphore;
+
+  class down_awaiter {
+  public:
+    explicit down_awaiter(sem_t *s) noexcept : s_(s) {}
+
+    bool await_ready() noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h) noexcept {
+      waiter_.ready.handle = h;
+      waiter_.tid = ut_self();
+      waiter_.wake = wake;
+      return binsem_down_async(s_, &waiter_) == 0;
+    }
+
+    void await_resume() noexcept {}
+
+  private:
+    struct waiter : binsem_waiter_t {
+      detail::ready_node ready;
+    };
+
+    static void wake(binsem_waiter_t *w) noexcept {
+      detail::executor::instance().post(&static_cast<waiter *>(w)->ready);
+    }
+
+    sem_t *s_;
+    waiter waiter_;
+  };
+
+  down_awaiter down() noexcept { return down_awaiter(native_handle()); }
+
+  void up() noexcept { release(); }
+};
+
+} // namespace ut
+
+#endif
@@ -0,0 +1,206 @@
+/*****************************************************************************
+   File:        ut_sched.h
+
+   Description: this file defines the scheduler hooks used by synchronization
+                objects built on top of the user-level threads library (like
+                channels). These are not meant to be called by the threads'
+                own code; use the objects built on them instead.
+
+                Every structure shared between threads is protected by the
+                scheduler lock, which keeps the scheduler from preempting the
+                lock holder. A thread that must wait registers itself in the
+                waiting list of the object it waits on, and then parks while
+                still holding the lock. Another thread that later holds the
+                lock removes it from that list and unparks it.
+ ****************************************************************************/
+#ifndef _UT_SCHED_H
+#define _UT_SCHED_H
+
+#include "trace.h"
+#include "ut.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*****************************************************************************
+ Acquires the scheduler lock, so the calling thread cannot be preempted until
+ it calls ut_sched_unlock(). This is the same as ut_preempt_disable() (so it
+ nests), since the scheduler structures are only shared by threads running on
+ the same kernel thread. Foreign kernel threads must synchronize with the
+ scheduler by other means (like ut_unpark_remote()).
+ ****************************************************************************/
+void ut_sched_lock(void);
+
+/*****************************************************************************
+ Releases the scheduler lock. A preemption that was due while the lock was
+ held takes place immediately.
+ ****************************************************************************/
+void ut_sched_unlock(void);
+
+/*****************************************************************************
+ Blocks the calling thread until some other thread calls ut_unpark() with its
+ TID. Must be called with the scheduler lock held, and returns with the lock
+ held again.
+
+ Returns:
+    0 - after the thread was unparked.
+    SYS_ERR - if the scheduler is not running, so nobody could unpark it.
+ ****************************************************************************/
+int ut_park(void);
+
+/*****************************************************************************
+ Like ut_park(), but the thread also wakes up at a deadline, and when it is
+ canceled (see ut_cancel). Must be called with the scheduler lock held, and
+ like ut_park() it may return 0 while the thread is still registered in the
+ waiting list, so the caller should re-check its condition and remove itself
+ from the list when it gives up. Returns right away if the deadline passed
+ or a cancel request is pending.
+
+ Parameters:
+    deadline - the ut_clock() time to give up at, or 0 for none.
+
+ Returns:
+    0 - after the thread was unparked.
+    UT_TIMEDOUT - once the deadline passed.
+    UT_CANCELED - if the thread was canceled (the request is consumed).
+    SYS_ERR - if the scheduler is not running, or the timer could not be
+    armed.
+ ****************************************************************************/
+int ut_park_until(unsigned long long deadline);
+
+/*****************************************************************************
+ Posts again a cancel request of the calling thread that ut_park_until()
+ consumed, for a caller whose operation completed while it was parked and
+ which therefore does not report UT_CANCELED. The next cancellation point
+ sees the request instead of it being lost. Must be called with the
+ scheduler lock held.
+ ****************************************************************************/
+void ut_cancel_restore(void);
+
+/*****************************************************************************
+ Makes a parked thread ready again by appending it to the run queue. Must be
+ called with the scheduler lock held. Unparking a thread that is not parked
+ has no effect.
+
+ Parameters:
+    tid - the TID of the parked thread.
+ ****************************************************************************/
+void ut_unpark(tid_t tid);
+
+/*****************************************************************************
+ Returns the state of a thread (one of the thread states defined in ut.h), or
+ UT_FREE for a TID outside the threads table. Safe to call without the lock,
+ in which case the state may change right after the call.
+
+ Parameters:
+    tid - a thread ID.
+ ****************************************************************************/
+int ut_thread_state(tid_t tid);
+
+/*****************************************************************************
+ Returns 1 if the caller is a user-level thread (that is, it runs on the
+ kernel thread which called ut_start(), while the scheduler is running), and
+ 0 if it is a foreign kernel thread or the scheduler is not running.
+ ****************************************************************************/
+int ut_in_scheduler(void);
+
+/*****************************************************************************
+ Unparks a parked thread from any kernel thread, without the scheduler lock.
+ The thread is appended to the run queue at the scheduler's next switch
+ (waking the scheduler if it is idle), and an unpark of a thread which is not
+ parked by then has no effect.
+
+ Parameters:
+    tid - the TID of the parked thread.
+ ****************************************************************************/
+void ut_unpark_remote(tid_t tid);
+
+/*****************************************************************************
+ Returns the scheduler's clock (CLOCK_MONOTONIC), in nanoseconds. Timer
+ deadlines are expressed in it.
+ ****************************************************************************/
+unsigned long long ut_clock(void);
+
+/*****************************************************************************
+ A timer, which the scheduler fires once its deadline passes. The structure is
+ owned by the caller (usually on the waiting thread's stack), and must stay in
+ place until the timer fired or was stopped.
+ ****************************************************************************/
+typedef struct ut_timer {
+    unsigned long long deadline;     // the ut_clock() time to fire at.
+    void (*fire)(struct ut_timer *); // called with the scheduler lock held,
+                                     // possibly by the signal handler, after
+                                     // the timer was disarmed. NULL unparks
+                                     // tid instead.
+    tid_t tid;                       // the thread to unpark if fire is NULL.
+    int index;                       // private, -1 while the timer is not armed.
+} ut_timer_t;
+
+/*****************************************************************************
+ Arms and disarms a timer. Must be called with the scheduler lock held.
+ Stopping a timer which is not armed has no effect, so a waiter can always
+ stop its timer once it wakes up, whatever woke it.
+
+ Returns (ut_timer_start):
+    0 - on success.
+    SYS_ERR - if the timers heap could not grow.
+ ****************************************************************************/
+int ut_timer_start(ut_timer_t *timer);
+void ut_timer_stop(ut_timer_t *timer);
+
+/*****************************************************************************
+ A wait for a file descriptor to become ready, which the scheduler fires once
+ poll(2) reports any event for it. The same ownership rules apply as for
+ ut_timer_t.
+ ****************************************************************************/
+typedef struct ut_io_wait {
+    int fd;
+    short events;                      // the events to wait for (see poll(2)).
+    short revents;                     // the events which occurred, set before
+                                       // the wait is fired.
+    void (*fire)(struct ut_io_wait *); // same as for ut_timer_t.
+    tid_t tid;
+    int index;                         // private, -1 while not waiting.
+} ut_io_wait_t;
+
+/*****************************************************************************
+ Starts and stops waiting for a file descriptor. Must be called with the
+ scheduler lock held.
+
+ Returns (ut_io_start):
+    0 - on success.
+    SYS_ERR - if the waits table could not grow.
+ ****************************************************************************/
+int ut_io_start(ut_io_wait_t *wait);
+void ut_io_stop(ut_io_wait_t *wait);
+
+/*****************************************************************************
+ Thin wrappers of the futex(2) system call on a process-private word.
+ ut_futex_wait() sleeps as long as *addr equals val (it may also return
+ early, so callers must re-check their condition), and ut_futex_wake() wakes
+ up to n kernel threads sleeping on addr.
+ ****************************************************************************/
+void ut_futex_wait(int *addr, int val);
+void ut_futex_wake(int *addr, int n);
+
+/*****************************************************************************
+ Records a trace event (see trace.h) if the trace recorder is started. Must be
+ called by the scheduler's kernel thread with the scheduler lock held, which
+ keeps every recording from being interrupted by another one.
+
+ Parameters:
+    type - one of the event types defined in trace.h.
+    tid - the thread the event is about.
+    arg - depends on the type.
+ ****************************************************************************/
+extern int ut_trace_on;
+void ut_trace_record(int type, int tid, int arg);
+#define UT_TRACE(type, tid, arg) \
+    do { if (ut_trace_on) ut_trace_record((type), (tid), (arg)); } while (0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif